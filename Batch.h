@@ -0,0 +1,221 @@
+/*
+	Batch - offline rendering of many note scripts across all cores
+
+	A manifest lists jobs, each a note script written straight to a WAV file.
+	Jobs are shared out to a pool of worker threads, every worker owning its
+	own synth::engine, so nothing is shared between jobs but the job list:
+
+		Synthesizer.exe --batch sounds.txt out [--threads 8]
+
+	Manifest format, one statement per line, '#' starts a comment:
+
+		job <name> <seconds>				starts a job, rendered to <out>/<name>.wav
+		hold <note> <channel> <on> <off>	a held note within the current job
+
+	Each statement takes exactly the fields shown, anything more on the line
+	is an error. Job names must be unique and plain file names, without path
+	separators or "..", so every job writes its own file inside <out>.
+
+	Per job render time and the aggregate throughput are printed once every
+	job has finished.
+
+	Requires FTYPE to be defined before inclusion.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <set>
+#include <algorithm>
+#include <cctype>
+#include <atomic>
+#include <thread>
+#include <chrono>
+using namespace std;
+
+#include "Render.h"
+#include "RealTime.h"
+
+namespace synth
+{
+	struct batch_result
+	{
+		bool bWritten;
+		double dRenderSeconds;
+		double dAudioSeconds;
+
+		batch_result()
+		{
+			bWritten = false;
+			dRenderSeconds = 0.0;
+			dAudioSeconds = 0.0;
+		}
+	};
+
+	//Windows file names are case insensitive, so "Bell" and "bell" are one file
+	inline string file_key(string sName)
+	{
+		transform(sName.begin(), sName.end(), sName.begin(), [](char c) { return (char)tolower((unsigned char)c); });
+		return sName;
+	}
+
+	//Returns false with the offending line in sError if the manifest is malformed
+	inline bool read_manifest(const string &sFileName, vector<note_script> &vecJobs, string &sError)
+	{
+		ifstream file(sFileName);
+		if (!file.is_open())
+		{
+			sError = "cannot open " + sFileName;
+			return false;
+		}
+
+		vecJobs.clear();
+		set<string> setNames;
+		string sLine;
+		int nLine = 0;
+		while (getline(file, sLine))
+		{
+			nLine++;
+			sLine = sLine.substr(0, sLine.find('#'));
+
+			istringstream line(sLine);
+			string sStatement;
+			if (!(line >> sStatement))
+				continue;
+
+			bool bValid = false;
+			string sReason = "cannot parse";
+			if (sStatement == "job")
+			{
+				note_script s;
+				bValid = (line >> s.sName >> s.dDuration) && s.dDuration > 0.0;
+				if (bValid && (s.sName.find_first_of("/\\:") != string::npos || s.sName.find("..") != string::npos))
+				{
+					bValid = false;
+					sReason = "job name must be a plain file name";
+				}
+				else if (bValid && !setNames.insert(file_key(s.sName)).second)
+				{
+					bValid = false;
+					sReason = "duplicate job name";
+				}
+
+				if (bValid)
+					vecJobs.push_back(s);
+			}
+			else if (sStatement == "hold" && !vecJobs.empty())
+			{
+				int nNoteID, nChannel;
+				FTYPE dOn, dOff;
+				bValid = (line >> nNoteID >> nChannel >> dOn >> dOff) && nChannel >= 0 && nChannel < 3 && dOff >= dOn;
+				if (bValid)
+					vecJobs.back().hold(nNoteID, nChannel, dOn, dOff);
+			}
+
+			string sExtra;
+			if (bValid && line >> sExtra)
+			{
+				bValid = false;
+				sReason = "unexpected \"" + sExtra + "\" after the statement";
+			}
+
+			if (!bValid)
+			{
+				sError = sFileName + "(" + to_string(nLine) + "): " + sReason + " \"" + sLine + "\"";
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	//Renders every job to sDirectory/<name>.wav, nThreads of 0 uses every core.
+	//Results are in job order.
+	inline vector<batch_result> run_batch(const vector<note_script> &vecJobs, const string &sDirectory, unsigned int nThreads = 0, const engine_rates &rates = engine_rates())
+	{
+		vector<batch_result> vecResults(vecJobs.size());
+		atomic<size_t> nNextJob(0);
+
+		auto worker = [&]()
+		{
+			EnableFlushToZero();
+			engine e(rates.nSampleRate);
+			rates.apply(e);
+			vector<FTYPE> vecOutput;
+
+			//Each job is claimed by exactly one worker, so its result slot is never shared
+			for (size_t j = nNextJob++; j < vecJobs.size(); j = nNextJob++)
+			{
+				auto tStart = chrono::high_resolution_clock::now();
+				render(e, vecJobs[j], vecOutput);
+				vecResults[j].bWritten = write_wav(sDirectory + "/" + vecJobs[j].sName + ".wav", vecOutput, rates.nSampleRate);
+				auto tEnd = chrono::high_resolution_clock::now();
+
+				vecResults[j].dRenderSeconds = chrono::duration<double>(tEnd - tStart).count();
+				vecResults[j].dAudioSeconds = vecJobs[j].dDuration;
+			}
+		};
+
+		if (nThreads == 0)
+			nThreads = (std::max)(thread::hardware_concurrency(), 1u);
+		nThreads = (std::min)(nThreads, (unsigned int)(std::max)(vecJobs.size(), (size_t)1));
+
+		vector<thread> vecWorkers;
+		for (unsigned int t = 0; t < nThreads; t++)
+			vecWorkers.push_back(thread(worker));
+		for (auto &t : vecWorkers)
+			t.join();
+
+		return vecResults;
+	}
+
+	//Command line entry, returns the number of jobs that failed
+	inline int run_batch_manifest(const string &sManifest, const string &sDirectory, unsigned int nThreads = 0, const engine_rates &rates = engine_rates())
+	{
+		vector<note_script> vecJobs;
+		string sError;
+		if (!read_manifest(sManifest, vecJobs, sError))
+		{
+			wcout << sError.c_str() << endl;
+			return 1;
+		}
+
+		if (nThreads == 0)
+			nThreads = (std::max)(thread::hardware_concurrency(), 1u);
+		wcout << "Rendering " << vecJobs.size() << " jobs to " << sDirectory.c_str() << " on " << nThreads << " threads" << endl << endl;
+
+		auto tStart = chrono::high_resolution_clock::now();
+		vector<batch_result> vecResults = run_batch(vecJobs, sDirectory, nThreads, rates);
+		auto tEnd = chrono::high_resolution_clock::now();
+
+		wcout << left << setw(24) << "job" << right << setw(10) << "audio s" << setw(12) << "render ms" << setw(10) << "x RT" << "  result" << endl;
+
+		int nFailures = 0;
+		double dAudioSeconds = 0.0;
+		for (size_t j = 0; j < vecJobs.size(); j++)
+		{
+			const batch_result &r = vecResults[j];
+			wcout << left << setw(24) << vecJobs[j].sName.c_str() << right << fixed
+				<< setw(10) << setprecision(2) << r.dAudioSeconds
+				<< setw(12) << setprecision(2) << r.dRenderSeconds * 1000.0
+				<< setw(10) << setprecision(1) << r.dAudioSeconds / (std::max)(r.dRenderSeconds, 1e-9)
+				<< "  " << (r.bWritten ? "written" : "WRITE FAILED") << endl;
+
+			if (!r.bWritten)
+				nFailures++;
+			dAudioSeconds += r.dAudioSeconds;
+		}
+
+		//Wall time includes thread start-up and file writes
+		double dWallSeconds = (std::max)(chrono::duration<double>(tEnd - tStart).count(), 1e-9);
+		wcout << endl << fixed << setprecision(2)
+			<< "Jobs " << vecJobs.size() << ", failed " << nFailures << endl
+			<< "Audio " << dAudioSeconds << " s in " << dWallSeconds << " s wall, " << setprecision(1) << dAudioSeconds / dWallSeconds << " x real-time" << endl
+			<< "Jobs per second " << vecJobs.size() / dWallSeconds << endl;
+
+		wcout << (nFailures == 0 ? "OK" : "FAILED") << endl;
+		return nFailures;
+	}
+}
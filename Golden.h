@@ -0,0 +1,482 @@
+/*
+	Golden - output regression checks for DSP changes
+
+	A fixed set of note scripts exercising every instrument is rendered
+	headless and compared against reference renders stored as WAV files.
+	"record" writes the references, "check" renders again and compares:
+
+		Synthesizer.exe --golden-record golden
+		Synthesizer.exe --golden-check golden [--max-abs 1e-4] [--snr 60] [--spectral 0.5]
+
+	Three measures are reported per script, each with its own tolerance:
+	  max abs   largest single sample difference
+	  SNR       reference energy over difference energy, in dB
+	  spectral  mean log-spectral distance over Hann windowed frames, in dB
+	Render time and real-time factor are reported alongside, so a speed-up
+	and its cost in accuracy are read off the same line. Both modes also
+	check that a note pressed on the first sample sounds and ends on every
+	channel, which a reference cannot catch if it was recorded silent.
+
+	The same scripts also check that --replay plays back sample accurately,
+	without an audio device (Synthesizer.exe --replay-check).
+
+	The references in golden/ are committed with the source. They are stored
+	as 32-bit float, so a render that matches exactly in FTYPE still differs
+	by up to half a float step per sample: max abs error floors near 1e-8
+	(and SNR near 150 dB) rather than reaching zero.
+
+	The same measures weigh up rendering instruments at a lower internal
+	rate and resampling them, either against direct rendering:
+
+		Synthesizer.exe --rate-bench [internal rate]
+		Synthesizer.exe --rate-bench --internal-rate 0 16000 --internal-rate 2 22050
+
+	or as a regression check of the resampled path. Resampled channels lag by
+	the resampler delay, so their references are recorded and checked with
+	the same --internal-rate options, in a directory of their own:
+
+		Synthesizer.exe --golden-record golden22k --internal-rate 0 22050
+		Synthesizer.exe --golden-check golden22k --internal-rate 0 22050
+
+	Requires FTYPE to be defined before inclusion.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <complex>
+using namespace std;
+
+#include "Render.h"
+#include "Input.h"
+
+namespace synth
+{
+	struct golden_tolerance
+	{
+		double dMaxAbsError;
+		double dMinSNR;
+		double dMaxSpectral;
+
+		golden_tolerance()
+		{
+			dMaxAbsError = 1e-4;
+			dMinSNR = 60.0;
+			dMaxSpectral = 0.5;
+		}
+	};
+
+	struct golden_result
+	{
+		double dMaxAbsError;
+		double dSNR;
+		double dSpectral;
+		double dRenderSeconds;
+		double dAudioSeconds;
+	};
+
+	//In-place radix 2 FFT, size must be a power of two
+	inline void fft(vector<complex<double>> &a)
+	{
+		size_t n = a.size();
+		for (size_t i = 1, j = 0; i < n; i++)
+		{
+			size_t bit = n >> 1;
+			for (; j & bit; bit >>= 1)
+				j ^= bit;
+			j ^= bit;
+			if (i < j)
+				swap(a[i], a[j]);
+		}
+
+		for (size_t len = 2; len <= n; len <<= 1)
+		{
+			complex<double> wlen(cos(-2.0 * PI / len), sin(-2.0 * PI / len));
+			for (size_t i = 0; i < n; i += len)
+			{
+				complex<double> w(1.0, 0.0);
+				for (size_t j = 0; j < len / 2; j++)
+				{
+					complex<double> u = a[i + j];
+					complex<double> v = a[i + j + len / 2] * w;
+					a[i + j] = u + v;
+					a[i + j + len / 2] = u - v;
+					w *= wlen;
+				}
+			}
+		}
+	}
+
+	//Differences in length count as error against silence
+	inline golden_result compare(const vector<FTYPE> &vecReference, const vector<FTYPE> &vecTest)
+	{
+		golden_result r;
+		size_t nSamples = (std::max)(vecReference.size(), vecTest.size());
+		auto at = [](const vector<FTYPE> &v, size_t n) { return n < v.size() ? (double)v[n] : 0.0; };
+
+		double dSignal = 0.0, dNoise = 0.0;
+		r.dMaxAbsError = 0.0;
+		for (size_t n = 0; n < nSamples; n++)
+		{
+			double dRef = at(vecReference, n);
+			double dErr = at(vecTest, n) - dRef;
+			dSignal += dRef * dRef;
+			dNoise += dErr * dErr;
+			r.dMaxAbsError = (std::max)(r.dMaxAbsError, fabs(dErr));
+		}
+		r.dSNR = dNoise > 0.0 ? 10.0 * log10(dSignal / dNoise) : 200.0;
+		if (r.dSNR > 200.0)
+			r.dSNR = 200.0;
+
+		//Log spectral distance, bins are floored at -100 dB so silence compares equal
+		const size_t nFrame = 1024, nHop = 512;
+		const double dFloor = 1e-5 * nFrame;
+		double dDistance = 0.0;
+		int nFrames = 0;
+		vector<complex<double>> vecRef(nFrame), vecTst(nFrame);
+		for (size_t nStart = 0; nStart + nFrame <= nSamples; nStart += nHop)
+		{
+			for (size_t i = 0; i < nFrame; i++)
+			{
+				double dWindow = 0.5 - 0.5 * cos(2.0 * PI * i / nFrame);
+				vecRef[i] = at(vecReference, nStart + i) * dWindow;
+				vecTst[i] = at(vecTest, nStart + i) * dWindow;
+			}
+			fft(vecRef);
+			fft(vecTst);
+
+			double dSum = 0.0;
+			for (size_t i = 0; i <= nFrame / 2; i++)
+			{
+				double dRefDB = 20.0 * log10((std::max)(abs(vecRef[i]), dFloor));
+				double dTstDB = 20.0 * log10((std::max)(abs(vecTst[i]), dFloor));
+				dSum += (dRefDB - dTstDB) * (dRefDB - dTstDB);
+			}
+			dDistance += sqrt(dSum / (nFrame / 2 + 1));
+			nFrames++;
+		}
+		r.dSpectral = nFrames > 0 ? dDistance / nFrames : 0.0;
+
+		r.dRenderSeconds = 0.0;
+		r.dAudioSeconds = 0.0;
+		return r;
+	}
+
+	inline bool passes(const golden_result &r, const golden_tolerance &tol)
+	{
+		return r.dMaxAbsError <= tol.dMaxAbsError && r.dSNR >= tol.dMinSNR && r.dSpectral <= tol.dMaxSpectral;
+	}
+
+	//Fixed scripts, changing any of these invalidates the stored references
+	inline vector<note_script> golden_scripts()
+	{
+		vector<note_script> vecScripts;
+		note_script s;
+
+		s = note_script();
+		s.sName = "piano_chord";
+		s.hold(0, 0, 0.10, 1.00);
+		s.hold(4, 0, 0.10, 1.00);
+		s.hold(7, 0, 0.10, 1.00);
+		s.hold(12, 0, 1.20, 1.60);
+		s.dDuration = 2.0;
+		vecScripts.push_back(s);
+
+		s = note_script();
+		s.sName = "harmonica_upper";
+		for (int k = 0; k < 6; k++)
+			s.hold(10 + k * 2, 1, 0.05 + k * 0.25, 0.40 + k * 0.25);
+		s.dDuration = 2.0;
+		vecScripts.push_back(s);
+
+		s = note_script();
+		s.sName = "bell_arpeggio";
+		s.hold(0, 2, 0.00, 1.50);
+		s.hold(4, 2, 0.25, 1.50);
+		s.hold(7, 2, 0.50, 1.50);
+		s.hold(12, 2, 0.75, 1.50);
+		s.dDuration = 3.0;
+		vecScripts.push_back(s);
+
+		s = note_script();
+		s.sName = "retrigger";		//Key pressed again during its release
+		s.hold(5, 0, 0.10, 0.50);
+		s.hold(5, 0, 0.505, 0.90);
+		s.hold(9, 2, 0.20, 0.30);
+		s.hold(9, 2, 0.60, 1.20);
+		s.dDuration = 2.0;
+		vecScripts.push_back(s);
+
+		s = note_script();
+		s.sName = "mixed";
+		s.hold(0, 0, 0.00, 2.00);
+		s.hold(7, 0, 0.00, 2.00);
+		s.hold(12, 1, 0.50, 1.50);
+		s.hold(16, 1, 0.75, 1.50);
+		s.hold(19, 2, 1.00, 1.25);
+		s.hold(24, 2, 1.10, 1.35);
+		s.dDuration = 3.0;
+		vecScripts.push_back(s);
+
+		return vecScripts;
+	}
+
+	//A note pressed on the very first sample must sound and must end. Scripts
+	//starting at time zero would otherwise record silence as their reference
+	//and compare equal to it. Returns the number of channels that failed.
+	inline int check_onsets(engine &e)
+	{
+		int nFailures = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			note_script s;
+			s.hold(0, c, 0.0, 0.25);
+			s.dDuration = 0.25 + e.instruments[c]->env.dReleaseTime + 0.1;
+
+			vector<FTYPE> vecOutput;
+			render(e, s, vecOutput);
+
+			double dPeak = 0.0;
+			for (size_t n = 0; n < (size_t)(0.25 * e.nSampleRate) && n < vecOutput.size(); n++)
+				dPeak = (std::max)(dPeak, fabs((double)vecOutput[n]));
+			size_t nLeft = e.voices();
+
+			bool bPass = dPeak > 1e-3 && nLeft == 0;
+			if (!bPass)
+				nFailures++;
+
+			wcout << "Onset at t=0 on channel " << c << ": peak " << scientific << setprecision(2) << dPeak
+				<< ", " << nLeft << " voices left  " << (bPass ? "pass" : "FAIL") << endl;
+		}
+		return nFailures;
+	}
+
+	//Returns the number of scripts that failed (or could not be written/read)
+	inline int run_golden(const string &sDirectory, bool bRecord, const golden_tolerance &tol, const engine_rates &rates = engine_rates())
+	{
+		unsigned int nSampleRate = rates.nSampleRate;
+		engine e(nSampleRate);
+		rates.apply(e);
+		int nFailures = 0;
+
+		wcout << (bRecord ? "Recording" : "Checking") << " golden output in " << sDirectory.c_str() << endl;
+		for (int c = 0; c < 3; c++)
+			if (rates.resampled(c))
+				wcout << "Channel " << c << " rendered at " << rates.nInternalRate[c] << " Hz and resampled" << endl;
+		wcout << endl;
+		wcout << left << setw(18) << "script" << right
+			<< setw(12) << "max abs" << setw(10) << "SNR dB" << setw(12) << "spectral"
+			<< setw(12) << "render ms" << setw(10) << "x RT" << "  result" << endl;
+
+		for (auto &script : golden_scripts())
+		{
+			vector<FTYPE> vecOutput;
+			auto tStart = chrono::high_resolution_clock::now();
+			render(e, script, vecOutput);
+			auto tEnd = chrono::high_resolution_clock::now();
+
+			golden_result r;
+			string sFile = sDirectory + "/" + script.sName + ".wav";
+			string sStatus;
+
+			if (bRecord)
+			{
+				r = compare(vecOutput, vecOutput);
+				sStatus = write_wav(sFile, vecOutput, nSampleRate) ? "written" : "WRITE FAILED";
+				if (sStatus != "written")
+					nFailures++;
+			}
+			else
+			{
+				vector<FTYPE> vecReference;
+				unsigned int nReferenceRate = 0;
+				if (!read_wav(sFile, vecReference, nReferenceRate) || nReferenceRate != nSampleRate)
+				{
+					r = compare(vecOutput, vecOutput);
+					sStatus = "NO REFERENCE";
+					nFailures++;
+				}
+				else
+				{
+					r = compare(vecReference, vecOutput);
+					sStatus = passes(r, tol) ? "pass" : "FAIL";
+					if (sStatus == "FAIL")
+						nFailures++;
+				}
+			}
+
+			r.dRenderSeconds = chrono::duration<double>(tEnd - tStart).count();
+			r.dAudioSeconds = script.dDuration;
+
+			wcout << left << setw(18) << script.sName.c_str() << right
+				<< setw(12) << scientific << setprecision(2) << r.dMaxAbsError
+				<< setw(10) << fixed << setprecision(1) << r.dSNR
+				<< setw(12) << setprecision(3) << r.dSpectral
+				<< setw(12) << setprecision(2) << r.dRenderSeconds * 1000.0
+				<< setw(10) << setprecision(1) << r.dAudioSeconds / (std::max)(r.dRenderSeconds, 1e-9)
+				<< "  " << sStatus.c_str() << endl;
+		}
+
+		if (!bRecord)
+			wcout << endl << "Tolerances: max abs " << scientific << setprecision(2) << tol.dMaxAbsError
+				<< fixed << setprecision(1) << ", SNR " << tol.dMinSNR << " dB, spectral " << setprecision(3) << tol.dMaxSpectral << " dB" << endl;
+
+		wcout << endl;
+		nFailures += check_onsets(e);
+
+		wcout << (nFailures == 0 ? "OK" : "FAILED") << endl;
+		return nFailures;
+	}
+
+	//Plays every golden script through ScriptedKeySource the way --replay does,
+	//on a stepped clock with the wake-up time jittered by up to a block either
+	//way, and compares it with render() of the same script. Events are keyed at
+	//the sample they are stamped with, so the two should agree exactly.
+	inline int run_replay_check(const golden_tolerance &tol, const engine_rates &rates = engine_rates(), unsigned int nBlockSamples = 512)
+	{
+		unsigned int nSampleRate = rates.nSampleRate;
+		double dTimeStep = 1.0 / (double)nSampleRate;
+		engine reference(nSampleRate), replayed(nSampleRate);
+		rates.apply(reference);
+		rates.apply(replayed);
+		int nFailures = 0;
+
+		wcout << "Replaying golden scripts through ScriptedKeySource against render()" << endl << endl;
+		wcout << left << setw(18) << "script" << right
+			<< setw(12) << "max abs" << setw(10) << "SNR dB" << setw(12) << "spectral" << setw(8) << "late" << "  result" << endl;
+
+		//The session joins a stream already running, at an offset off the block grid
+		unsigned long long nLead = nSampleRate / 10;
+		unsigned long long nStart = nLead + 3 * nBlockSamples + 37;
+
+		unsigned int nJitter = 1;
+		for (auto &script : golden_scripts())
+		{
+			//The reference is the script moved to where the session starts. render()
+			//applies events on the first sample at or after their time, the replay
+			//on the nearest, so it is put on the sample grid as well.
+			note_script s = script;
+			vector<KeyEvent> vecEvents;
+			for (auto &ev : s.vecEvents)
+			{
+				long long nSample = (long long)floor(ev.dTime * nSampleRate + 0.5);
+				vecEvents.push_back(KeyEvent((double)nSample * dTimeStep, ev.nNoteID, ev.nChannel, ev.bPressed));
+				ev.dTime = (FTYPE)((double)(nStart + nSample) * dTimeStep);
+			}
+			s.dDuration += (FTYPE)((double)nStart * dTimeStep);
+
+			vector<FTYPE> vecReference;
+			render(reference, s, vecReference, nBlockSamples);
+
+			ScriptedKeySource keys(vecEvents, script.dDuration, (long long)nStart, nSampleRate);
+
+			replayed.reset();
+			vector<FTYPE> vecOutput(vecReference.size(), 0.0);
+			int nLate = 0;
+			for (size_t n = 0; n < vecOutput.size(); n += nBlockSamples)
+			{
+				nJitter = nJitter * 1664525u + 1013904223u;
+				double dJitter = ((double)(nJitter >> 8) / 16777216.0 * 2.0 - 1.0) * nBlockSamples * dTimeStep;
+				double dElapsed = (double)((long long)n - (long long)(nStart - nLead)) * dTimeStep + dJitter;
+
+				KeyEvent ev;
+				while (keys.Due(dElapsed, ev))
+				{
+					if (ev.nSample < (long long)n)
+						nLate++;
+					replayed.key(ev.nKey, ev.nChannel, ev.bPressed, (FTYPE)((double)ev.nSample * dTimeStep));
+				}
+
+				unsigned int nCount = (unsigned int)(std::min)((size_t)nBlockSamples, vecOutput.size() - n);
+				replayed.render(n, &vecOutput[n], nCount);
+			}
+
+			golden_result r = compare(vecReference, vecOutput);
+			bool bPass = passes(r, tol) && nLate == 0;
+			if (!bPass)
+				nFailures++;
+
+			wcout << left << setw(18) << s.sName.c_str() << right
+				<< setw(12) << scientific << setprecision(2) << r.dMaxAbsError
+				<< setw(10) << fixed << setprecision(1) << r.dSNR
+				<< setw(12) << setprecision(3) << r.dSpectral
+				<< setw(8) << nLate
+				<< "  " << (bPass ? "pass" : "FAIL") << endl;
+		}
+
+		wcout << (nFailures == 0 ? "OK" : "FAILED") << endl;
+		return nFailures;
+	}
+
+	//Each channel with an internal rate in rates rendered at it and resampled,
+	//against rendering it at the output rate. Channels are compared one at a
+	//time, with only their own events, so each can have its resampler delay
+	//taken off.
+	inline void run_rate_benchmark(const engine_rates &rates)
+	{
+		unsigned int nSampleRate = rates.nSampleRate;
+		vector<note_script> vecScripts = golden_scripts();
+		note_script dense;
+		dense.sName = "dense";
+		for (int k = 0; k < 16; k++)
+		{
+			dense.hold(k, 0, 0.01 * k, 2.0);
+			dense.hold(k + 12, 2, 0.02 * k + 0.005, 2.0);
+		}
+		dense.dDuration = 3.0;
+		vecScripts.push_back(dense);
+
+		engine direct(nSampleRate), resampled(nSampleRate);
+		rates.apply(resampled);
+
+		for (int c = 0; c < 3; c++)
+		{
+			if (!rates.resampled(c))
+				continue;
+
+			double dDelay = resampled.instruments[c]->rs.delay();
+			size_t nDelay = (size_t)floor(dDelay + 0.5);
+
+			wcout << "Channel " << c << " at " << rates.nInternalRate[c] << " Hz resampled to " << nSampleRate << " Hz, against direct rendering" << endl;
+			wcout << "Resampler delay " << fixed << setprecision(2) << dDelay << " samples" << (dDelay == (double)nDelay ? "" : ", compared rounded") << endl << endl;
+			wcout << left << setw(18) << "script" << right
+				<< setw(12) << "direct ms" << setw(14) << "resampled ms" << setw(10) << "speed-up"
+				<< setw(12) << "max abs" << setw(10) << "SNR dB" << setw(12) << "spectral" << endl;
+
+			for (auto &script : vecScripts)
+			{
+				note_script s = script;
+				s.vecEvents.clear();
+				for (auto &ev : script.vecEvents)
+					if (ev.nChannel == c)
+						s.vecEvents.push_back(ev);
+				if (s.vecEvents.empty())
+					continue;
+
+				vector<FTYPE> vecDirect, vecResampled;
+				auto tStart = chrono::high_resolution_clock::now();
+				render(direct, s, vecDirect);
+				auto tMiddle = chrono::high_resolution_clock::now();
+				render(resampled, s, vecResampled);
+				auto tEnd = chrono::high_resolution_clock::now();
+
+				vecResampled.erase(vecResampled.begin(), vecResampled.begin() + (std::min)(nDelay, vecResampled.size()));
+				vecDirect.resize(vecResampled.size());
+				golden_result r = compare(vecDirect, vecResampled);
+
+				double dDirect = chrono::duration<double>(tMiddle - tStart).count();
+				double dResampled = chrono::duration<double>(tEnd - tMiddle).count();
+				wcout << left << setw(18) << s.sName.c_str() << right << fixed
+					<< setw(12) << setprecision(2) << dDirect * 1000.0
+					<< setw(14) << setprecision(2) << dResampled * 1000.0
+					<< setw(10) << setprecision(2) << dDirect / (std::max)(dResampled, 1e-9)
+					<< setw(12) << scientific << setprecision(2) << r.dMaxAbsError
+					<< setw(10) << fixed << setprecision(1) << r.dSNR
+					<< setw(12) << setprecision(3) << r.dSpectral << endl;
+			}
+			wcout << endl;
+		}
+	}
+}
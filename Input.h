@@ -0,0 +1,234 @@
+/*
+	Input - event driven key sources for playing the synth
+
+	The interactive loop used to poll every key with GetAsyncKeyState() as
+	fast as it could, keeping a core busy and the note mutex contended. A
+	KeySource instead sleeps until a key changes state and hands back only
+	that transition, or gives up after a timeout so the caller can refresh
+	its display at a fixed rate.
+
+	ConsoleKeySource reads key down/up records from the console input
+	buffer. Keys auto-repeat there, so repeated downs are filtered out, and
+	every held key is released if the console loses focus (the key up would
+	go to another window). Without a console on standard input (redirected
+	or piped) there are no key records to read, so the source reports
+	IsConsole() false and is finished from the start. ScriptedKeySource replays a fixed list of timed
+	transitions through the same interface, for repeatable sessions. Its
+	events carry the engine sample they are due at, so the replay does not
+	depend on when the thread happened to wake.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cmath>
+using namespace std;
+
+#include <Windows.h>
+
+struct KeyEvent
+{
+	double dTime;		// Seconds from the start, used by scripted sources
+	long long nSample;	// Engine sample the event is due at, -1 to apply it on arrival
+	int nKey;
+	int nChannel;
+	bool bPressed;
+
+	KeyEvent(double t = 0.0, int key = 0, int channel = 0, bool pressed = true)
+	{
+		dTime = t;
+		nSample = -1;
+		nKey = key;
+		nChannel = channel;
+		bPressed = pressed;
+	}
+};
+
+class KeySource
+{
+public:
+	virtual ~KeySource()
+	{
+	}
+
+	// Blocks until a key changes state or nTimeoutMs passes, returns false on timeout
+	virtual bool Wait(KeyEvent &e, unsigned int nTimeoutMs) = 0;
+
+	// True once the source has nothing more to deliver
+	virtual bool Finished() = 0;
+};
+
+class ConsoleKeySource : public KeySource
+{
+public:
+	// Virtual key codes in note order, the layout drawn by main()
+	ConsoleKeySource(const char *sKeys = "ZSXCFVGBNJMK\xbcL\xbe\xbf", int nChannel = 0)
+	{
+		m_sKeys = sKeys;
+		m_nChannel = nChannel;
+		m_vecHeld.assign(m_sKeys.size(), false);
+
+		// Raw key records, no line editing or echo
+		m_hInput = GetStdHandle(STD_INPUT_HANDLE);
+		m_nOldMode = 0;
+		m_bConsole = GetConsoleMode(m_hInput, &m_nOldMode) != FALSE;
+		if (m_bConsole)
+			SetConsoleMode(m_hInput, m_nOldMode & ~(ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT));
+		m_bFinished = !m_bConsole;
+	}
+
+	~ConsoleKeySource()
+	{
+		if (m_bConsole)
+			SetConsoleMode(m_hInput, m_nOldMode);
+	}
+
+	// False if standard input is not a console, the source then delivers nothing
+	bool IsConsole()
+	{
+		return m_bConsole;
+	}
+
+	bool Wait(KeyEvent &e, unsigned int nTimeoutMs)
+	{
+		auto tDeadline = chrono::steady_clock::now() + chrono::milliseconds(nTimeoutMs);
+		while (true)
+		{
+			if (!m_vecPending.empty())
+			{
+				e = m_vecPending.front();
+				m_vecPending.erase(m_vecPending.begin());
+				return true;
+			}
+
+			long long nRemaining = chrono::duration_cast<chrono::milliseconds>(tDeadline - chrono::steady_clock::now()).count();
+			if (m_bFinished || nRemaining <= 0 || WaitForSingleObject(m_hInput, (DWORD)nRemaining) != WAIT_OBJECT_0)
+				return false;
+
+			INPUT_RECORD record;
+			DWORD nRead = 0;
+			if (!ReadConsoleInputW(m_hInput, &record, 1, &nRead))
+			{
+				// The handle stays signalled, retrying would spin
+				m_bFinished = true;
+				ReleaseAll();
+				continue;
+			}
+			if (nRead == 0)
+				continue;
+
+			if (record.EventType == KEY_EVENT)
+			{
+				const KEY_EVENT_RECORD &key = record.Event.KeyEvent;
+				if (key.wVirtualKeyCode == VK_ESCAPE)
+				{
+					m_bFinished = true;
+					ReleaseAll();
+					continue;
+				}
+
+				size_t k = m_sKeys.find((char)key.wVirtualKeyCode);
+				bool bPressed = key.bKeyDown != FALSE;
+				if (k != string::npos && m_vecHeld[k] != bPressed)
+				{
+					m_vecHeld[k] = bPressed;
+					e = KeyEvent(0.0, (int)k, m_nChannel, bPressed);
+					return true;
+				}
+			}
+			else if (record.EventType == FOCUS_EVENT && !record.Event.FocusEvent.bSetFocus)
+				ReleaseAll();
+		}
+	}
+
+	// Escape ends the session, after its releases have been delivered
+	bool Finished()
+	{
+		return m_bFinished && m_vecPending.empty();
+	}
+
+private:
+	HANDLE m_hInput;
+	DWORD m_nOldMode;
+	bool m_bConsole;
+	string m_sKeys;
+	int m_nChannel;
+	bool m_bFinished;
+	vector<bool> m_vecHeld;
+	vector<KeyEvent> m_vecPending;
+
+	void ReleaseAll()
+	{
+		for (size_t k = 0; k < m_vecHeld.size(); k++)
+		{
+			if (m_vecHeld[k])
+				m_vecPending.push_back(KeyEvent(0.0, (int)k, m_nChannel, false));
+			m_vecHeld[k] = false;
+		}
+	}
+};
+
+class ScriptedKeySource : public KeySource
+{
+public:
+	// Events are delivered at their dTime after construction, the session
+	// lasts dDuration seconds so release tails are heard out. Each is stamped
+	// with sample nStartSample + dTime * nSampleRate, so nStartSample should be
+	// far enough ahead of the engine that no event arrives after its sample.
+	ScriptedKeySource(const vector<KeyEvent> &vecEvents, double dDuration, long long nStartSample = 0, unsigned int nSampleRate = 44100)
+	{
+		m_vecEvents = vecEvents;
+		stable_sort(m_vecEvents.begin(), m_vecEvents.end(), [](KeyEvent const& a, KeyEvent const& b) { return a.dTime < b.dTime; });
+		m_nNext = 0;
+		m_dDuration = dDuration;
+		m_nStartSample = nStartSample;
+		m_nSampleRate = nSampleRate;
+		m_tStart = chrono::steady_clock::now();
+	}
+
+	bool Wait(KeyEvent &e, unsigned int nTimeoutMs)
+	{
+		auto tDeadline = chrono::steady_clock::now() + chrono::milliseconds(nTimeoutMs);
+		if (m_nNext < m_vecEvents.size())
+		{
+			auto tDue = m_tStart + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(m_vecEvents[m_nNext].dTime));
+			if (tDue <= tDeadline)
+			{
+				this_thread::sleep_until(tDue);
+				return Due(m_vecEvents[m_nNext].dTime, e);
+			}
+		}
+
+		this_thread::sleep_until(tDeadline);
+		return false;
+	}
+
+	// Takes the next event if it is due dElapsed seconds into the session,
+	// without waiting, so a session can be stepped without a real clock
+	bool Due(double dElapsed, KeyEvent &e)
+	{
+		if (m_nNext >= m_vecEvents.size() || m_vecEvents[m_nNext].dTime > dElapsed)
+			return false;
+
+		e = m_vecEvents[m_nNext++];
+		e.nSample = m_nStartSample + (long long)floor(e.dTime * m_nSampleRate + 0.5);
+		return true;
+	}
+
+	bool Finished()
+	{
+		return m_nNext >= m_vecEvents.size() && chrono::steady_clock::now() - m_tStart >= chrono::duration<double>(m_dDuration);
+	}
+
+private:
+	vector<KeyEvent> m_vecEvents;
+	size_t m_nNext;
+	double m_dDuration;
+	long long m_nStartSample;
+	unsigned int m_nSampleRate;
+	chrono::steady_clock::time_point m_tStart;
+};
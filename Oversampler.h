@@ -0,0 +1,193 @@
+/*
+	Oversampler - decimation back to the output rate for oversampled buses
+
+	Hard edged oscillators (OSC_SQUARE, OSC_SAW_OP) have harmonics far above
+	Nyquist that fold back as inharmonic aliasing. Rendering them at 2x/4x/8x
+	and low-passing on the way down pushes most of that fold-back out of the
+	audible band.
+
+	Decimation is a cascade of half-band FIR stages, each halving the rate.
+	Every other tap of a half-band filter is zero, so each stage splits into
+	two polyphase branches: an FIR over the even input samples and a plain
+	delay over the odd ones, computed once per output sample. The first
+	stages only have to protect the final passband and use short filters,
+	the last stage sets the passband edge and gets the long one.
+
+	Requires FTYPE to be defined before inclusion.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <emmintrin.h>
+using namespace std;
+
+namespace synth
+{
+	// Dot product over contiguous arrays, the inner loop of every stage
+	inline double dot(const double *a, const double *b, int n)
+	{
+		__m128d vSum = _mm_setzero_pd();
+		int i = 0;
+		for (; i + 2 <= n; i += 2)
+			vSum = _mm_add_pd(vSum, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+
+		double dSum[2];
+		_mm_storeu_pd(dSum, vSum);
+		dSum[0] += dSum[1];
+
+		for (; i < n; i++)
+			dSum[0] += a[i] * b[i];
+
+		return dSum[0];
+	}
+
+	inline float dot(const float *a, const float *b, int n)
+	{
+		__m128 vSum = _mm_setzero_ps();
+		int i = 0;
+		for (; i + 4 <= n; i += 4)
+			vSum = _mm_add_ps(vSum, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+
+		float fSum[4];
+		_mm_storeu_ps(fSum, vSum);
+		fSum[0] += fSum[1] + fSum[2] + fSum[3];
+
+		for (; i < n; i++)
+			fSum[0] += a[i] * b[i];
+
+		return fSum[0];
+	}
+
+	// Zeroth order modified Bessel function, for the Kaiser window
+	inline double bessel_i0(double x)
+	{
+		double dSum = 1.0, dTerm = 1.0;
+		for (int k = 1; k < 32; k++)
+		{
+			dTerm *= (x / (2.0 * k)) * (x / (2.0 * k));
+			dSum += dTerm;
+		}
+		return dSum;
+	}
+
+	struct halfband_decimator
+	{
+		vector<FTYPE> vecCoeff;		// Even branch taps
+		vector<FTYPE> vecEven;		// Even branch delay line, stored twice so the window is contiguous
+		vector<FTYPE> vecOdd;		// Odd branch delay
+		int nTaps;
+		int nEvenPos;
+		int nOddPos;
+
+		halfband_decimator()
+		{
+			init(23);
+		}
+
+		// nTaps must be of the form 4k+3 so the outermost taps are non-zero
+		void init(int nFilterTaps)
+		{
+			nTaps = nFilterTaps;
+			int nCentre = (nTaps - 1) / 2;
+			int nEven = (nTaps + 1) / 2;
+
+			// Kaiser windowed sinc with its cut-off at a quarter of the input rate
+			const double dBeta = 8.0;
+			vecCoeff.assign(nEven, 0.0);
+			double dSum = 0.0;
+			for (int j = 0; j < nEven; j++)
+			{
+				int m = 2 * j - nCentre;
+				double r = (double)m / (double)nCentre;
+				double dWindow = bessel_i0(dBeta * sqrt(1.0 - r * r)) / bessel_i0(dBeta);
+				double dSinc = sin(PI * m / 2.0) / (PI * m);
+				vecCoeff[j] = (FTYPE)(dSinc * dWindow);
+				dSum += dSinc * dWindow;
+			}
+
+			// Unity gain at DC, the centre tap supplies the other half
+			for (auto &c : vecCoeff)
+				c = (FTYPE)(c * 0.5 / dSum);
+
+			reset();
+		}
+
+		void reset()
+		{
+			vecEven.assign(vecCoeff.size() * 2, 0.0);
+			vecOdd.assign((nTaps + 1) / 4, 0.0);
+			nEvenPos = 0;
+			nOddPos = 0;
+		}
+
+		// Two input samples in, one output sample out
+		FTYPE process(FTYPE dEven, FTYPE dOdd)
+		{
+			int nEven = (int)vecCoeff.size();
+			nEvenPos = (nEvenPos == 0 ? nEven : nEvenPos) - 1;
+			vecEven[nEvenPos] = dEven;
+			vecEven[nEvenPos + nEven] = dEven;
+
+			FTYPE dOutput = dot(&vecEven[nEvenPos], &vecCoeff[0], nEven) + (FTYPE)0.5 * vecOdd[nOddPos];
+
+			vecOdd[nOddPos] = dOdd;
+			nOddPos = (nOddPos + 1) % (int)vecOdd.size();
+
+			return dOutput;
+		}
+	};
+
+	struct oversampler
+	{
+		int nFactor;
+		vector<halfband_decimator> vecStages;	// Highest rate first
+		FTYPE dScratch[8];
+
+		oversampler()
+		{
+			set_factor(1);
+		}
+
+		// 1 (off), 2, 4 or 8
+		void set_factor(int nNewFactor)
+		{
+			nFactor = nNewFactor >= 8 ? 8 : nNewFactor >= 4 ? 4 : nNewFactor >= 2 ? 2 : 1;
+
+			vecStages.clear();
+			for (int nRate = nFactor; nRate > 1; nRate /= 2)
+			{
+				halfband_decimator stage;
+				stage.init(nRate == 2 ? 63 : 23);
+				vecStages.push_back(stage);
+			}
+		}
+
+		void reset()
+		{
+			for (auto &s : vecStages)
+				s.reset();
+		}
+
+		// Takes nFactor consecutive samples, returns one at the output rate
+		FTYPE process(const FTYPE *pInput)
+		{
+			if (nFactor == 1)
+				return pInput[0];
+
+			for (int n = 0; n < nFactor; n++)
+				dScratch[n] = pInput[n];
+
+			int nSamples = nFactor;
+			for (auto &s : vecStages)
+			{
+				for (int n = 0; n < nSamples / 2; n++)
+					dScratch[n] = s.process(dScratch[2 * n], dScratch[2 * n + 1]);
+				nSamples /= 2;
+			}
+
+			return dScratch[0];
+		}
+	};
+}
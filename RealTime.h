@@ -0,0 +1,282 @@
+/*
+	RealTime - scheduling and floating point setup for audio threads
+
+	Decaying envelopes and filter tails slide into denormal numbers, which the
+	FPU handles in microcode at many times the normal cost. Flush-to-zero and
+	denormals-are-zero make the SSE unit treat them as 0.0 instead.
+
+	Windows has no SCHED_FIFO or mlockall(), the nearest equivalents are used.
+	THREAD_PRIORITY_TIME_CRITICAL alone is only the top of the dynamic range
+	(base priority 15 in a normal process), so the thread also registers with
+	the Multimedia Class Scheduler as a "Pro Audio" task, which moves it into
+	the real-time range, and the process priority class can be raised. Add
+	SetThreadAffinityMask() and VirtualLock() on the buffers the audio thread
+	touches (after growing the working set so the lock is allowed). Every call
+	can be refused, so ApplyRealTime() returns a report of what was actually
+	granted rather than what was asked for.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <xmmintrin.h>
+#include <pmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+using namespace std;
+
+#include <Windows.h>
+#include <avrt.h>
+#pragma comment(lib, "avrt.lib")
+
+struct RealTimeConfig
+{
+	const wchar_t *sMMCSSTask;	// Multimedia Class Scheduler task, nullptr to skip
+	DWORD nPriorityClass;		// *_PRIORITY_CLASS for the process, 0 leaves it alone
+	int nPriority;				// THREAD_PRIORITY_* for the audio thread
+	DWORD_PTR nAffinityMask;	// CPUs the thread may run on, 0 leaves it unpinned
+	bool bLockMemory;			// Keep audio buffers resident in RAM
+	bool bFlushDenormals;		// Set FTZ and DAZ on the thread
+
+	RealTimeConfig()
+	{
+		sMMCSSTask = L"Pro Audio";
+		nPriorityClass = 0;
+		nPriority = THREAD_PRIORITY_TIME_CRITICAL;
+		nAffinityMask = 0;
+		bLockMemory = true;
+		bFlushDenormals = true;
+	}
+};
+
+struct RealTimeReport
+{
+	bool bMMCSS;
+	HANDLE hMMCSS;				// Pass to RevertRealTime() before the thread ends
+	DWORD nPriorityClass;		// Class the process actually has
+	bool bPriority;
+	int nPriority;
+	bool bAffinity;
+	DWORD_PTR nAffinityMask;
+	bool bMemoryLocked;
+	bool bFlushToZero;
+	bool bDenormalsAreZero;
+	bool bRecorderLocked;
+	bool bSharedRingLocked;
+	bool bEngineLocked;			// Buffers of the block function, locked by their owner
+	SIZE_T nEngineBytes;
+	int nEngineVoices;			// Voices the engine buffers were sized for
+	bool bCacheLocking;			// Pre-rendered note segments are locked as they are made
+
+	RealTimeReport()
+	{
+		bMMCSS = false;
+		hMMCSS = nullptr;
+		nPriorityClass = NORMAL_PRIORITY_CLASS;
+		bPriority = false;
+		nPriority = THREAD_PRIORITY_NORMAL;
+		bAffinity = false;
+		nAffinityMask = 0;
+		bMemoryLocked = false;
+		bFlushToZero = false;
+		bDenormalsAreZero = false;
+		bRecorderLocked = false;
+		bSharedRingLocked = false;
+		bEngineLocked = false;
+		nEngineBytes = 0;
+		nEngineVoices = 0;
+		bCacheLocking = false;
+	}
+
+	// Scheduled in the real-time range rather than the dynamic one
+	bool IsRealTime() const
+	{
+		return bMMCSS || nPriorityClass == REALTIME_PRIORITY_CLASS;
+	}
+};
+
+// MXCSR is per thread, so this must run on the thread doing the maths.
+// Returns true if FTZ is in effect afterwards, bDAZ reports DAZ separately as
+// it is missing on the earliest SSE2 parts and setting it there would fault.
+inline bool EnableFlushToZero(bool &bDAZ)
+{
+	_MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+
+	bool bSSE3 = true;
+#ifdef _MSC_VER
+	int nCpuInfo[4];
+	__cpuid(nCpuInfo, 1);
+	bSSE3 = (nCpuInfo[2] & 1) != 0;
+#endif
+	if (bSSE3)
+		_MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+
+	bDAZ = _MM_GET_DENORMALS_ZERO_MODE() == _MM_DENORMALS_ZERO_ON;
+	return _MM_GET_FLUSH_ZERO_MODE() == _MM_FLUSH_ZERO_ON;
+}
+
+inline bool EnableFlushToZero()
+{
+	bool bDAZ;
+	return EnableFlushToZero(bDAZ);
+}
+
+// Pins a buffer in physical memory so the audio thread never page faults on it
+inline bool LockMemory(void *pAddress, SIZE_T nBytes)
+{
+	SIZE_T nMin = 0, nMax = 0;
+	if (!GetProcessWorkingSetSize(GetCurrentProcess(), &nMin, &nMax))
+		return false;
+
+	// VirtualLock is limited by the minimum working set, so grow it first
+	const SIZE_T nSlack = 64 * 1024;
+	if (!SetProcessWorkingSetSize(GetCurrentProcess(), nMin + nBytes + nSlack, nMax + nBytes + nSlack))
+		return false;
+
+	return VirtualLock(pAddress, nBytes) != FALSE;
+}
+
+// Undoes LockMemory() before a buffer is freed. Only pages wholly inside the
+// buffer are unlocked, the pages at either end may hold other locked data.
+inline bool UnlockMemory(void *pAddress, SIZE_T nBytes)
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	ULONG_PTR nPage = info.dwPageSize;
+	ULONG_PTR nFirst = ((ULONG_PTR)pAddress + nPage - 1) / nPage * nPage;
+	ULONG_PTR nLast = ((ULONG_PTR)pAddress + nBytes) / nPage * nPage;
+	bool bUnlocked = nLast <= nFirst || VirtualUnlock((void*)nFirst, nLast - nFirst) != FALSE;
+
+	// Give back the working set LockMemory() asked for
+	SIZE_T nMin = 0, nMax = 0;
+	const SIZE_T nSlack = 64 * 1024;
+	if (GetProcessWorkingSetSize(GetCurrentProcess(), &nMin, &nMax) && nMin > nBytes + nSlack)
+		SetProcessWorkingSetSize(GetCurrentProcess(), nMin - nBytes - nSlack, nMax - nBytes - nSlack);
+
+	return bUnlocked;
+}
+
+// Applies priority, affinity and FP mode to the calling thread. Memory locking
+// is per buffer, so it is left to the owner of the buffers (see LockMemory).
+inline RealTimeReport ApplyRealTime(const RealTimeConfig &config)
+{
+	RealTimeReport report;
+	HANDLE hThread = GetCurrentThread();
+
+	// REALTIME_PRIORITY_CLASS needs the increase base priority privilege,
+	// without it Windows quietly gives HIGH instead, so read back the result
+	if (config.nPriorityClass != 0)
+		SetPriorityClass(GetCurrentProcess(), config.nPriorityClass);
+	report.nPriorityClass = GetPriorityClass(GetCurrentProcess());
+
+	if (config.sMMCSSTask != nullptr)
+	{
+		DWORD nTaskIndex = 0;
+		report.hMMCSS = AvSetMmThreadCharacteristicsW(config.sMMCSSTask, &nTaskIndex);
+		report.bMMCSS = report.hMMCSS != nullptr;
+	}
+
+	if (SetThreadPriority(hThread, config.nPriority))
+	{
+		report.nPriority = GetThreadPriority(hThread);
+		report.bPriority = report.nPriority == config.nPriority;
+	}
+
+	if (config.nAffinityMask != 0)
+	{
+		DWORD_PTR nProcessMask = 0, nSystemMask = 0;
+		GetProcessAffinityMask(GetCurrentProcess(), &nProcessMask, &nSystemMask);
+
+		DWORD_PTR nMask = config.nAffinityMask & nProcessMask;
+		if (nMask != 0 && SetThreadAffinityMask(hThread, nMask) != 0)
+		{
+			report.bAffinity = true;
+			report.nAffinityMask = nMask;
+		}
+	}
+
+	if (config.bFlushDenormals)
+		report.bFlushToZero = EnableFlushToZero(report.bDenormalsAreZero);
+
+	return report;
+}
+
+// Undoes what outlives the thread, call from the thread before it returns
+inline void RevertRealTime(RealTimeReport &report)
+{
+	if (report.hMMCSS != nullptr)
+		AvRevertMmThreadCharacteristics(report.hMMCSS);
+	report.hMMCSS = nullptr;
+}
+
+// Command line names of the process priority classes, 0 if there is no such class
+inline DWORD ParsePriorityClass(const string &sName)
+{
+	if (sName == "realtime") return REALTIME_PRIORITY_CLASS;
+	if (sName == "high") return HIGH_PRIORITY_CLASS;
+	if (sName == "above-normal") return ABOVE_NORMAL_PRIORITY_CLASS;
+	if (sName == "normal") return NORMAL_PRIORITY_CLASS;
+	if (sName == "below-normal") return BELOW_NORMAL_PRIORITY_CLASS;
+	if (sName == "idle") return IDLE_PRIORITY_CLASS;
+	return 0;
+}
+
+inline const wchar_t *PriorityClassName(DWORD nClass)
+{
+	switch (nClass)
+	{
+	case REALTIME_PRIORITY_CLASS: return L"realtime";
+	case HIGH_PRIORITY_CLASS: return L"high";
+	case ABOVE_NORMAL_PRIORITY_CLASS: return L"above normal";
+	case NORMAL_PRIORITY_CLASS: return L"normal";
+	case BELOW_NORMAL_PRIORITY_CLASS: return L"below normal";
+	case IDLE_PRIORITY_CLASS: return L"idle";
+	default: return L"unknown";
+	}
+}
+
+// Startup self-check, printed so a glitchy host can be diagnosed at a glance
+inline void PrintRealTimeReport(const RealTimeConfig &config, const RealTimeReport &report)
+{
+	wcout << "Audio thread:" << endl;
+	wcout << "  Scheduling     " << (report.IsRealTime() ? "real-time range" : "DYNAMIC RANGE ONLY (not real-time)") << endl;
+
+	if (config.sMMCSSTask != nullptr)
+		wcout << "  MMCSS          " << (report.bMMCSS ? "granted" : "DENIED") << " (" << config.sMMCSSTask << ")" << endl;
+	else
+		wcout << "  MMCSS          not requested" << endl;
+
+	wcout << "  Process class  " << PriorityClassName(report.nPriorityClass);
+	if (config.nPriorityClass != 0 && config.nPriorityClass != report.nPriorityClass)
+		wcout << ", asked for " << PriorityClassName(config.nPriorityClass);
+	wcout << endl;
+
+	wcout << "  Thread prio    " << (report.bPriority ? "granted" : "DENIED") << " (" << report.nPriority << ")" << endl;
+
+	if (config.nAffinityMask != 0)
+		wcout << "  CPU affinity   " << (report.bAffinity ? "granted" : "DENIED") << " (0x" << hex << report.nAffinityMask << dec << ")" << endl;
+	else
+		wcout << "  CPU affinity   not requested" << endl;
+
+	if (config.bLockMemory)
+	{
+		wcout << "  Device buffers " << (report.bMemoryLocked ? "locked" : "DENIED") << " (wave blocks, headers, mix)" << endl;
+		wcout << "  Recorder ring  " << (report.bRecorderLocked ? "locked" : "not locked or not recording") << endl;
+		wcout << "  Shared ring    " << (report.bSharedRingLocked ? "locked" : "not locked or not publishing") << endl;
+		if (report.nEngineBytes != 0)
+			wcout << "  Engine         " << (report.bEngineLocked ? "locked" : "DENIED") << " (" << report.nEngineBytes / 1024 << " KB, sized for "
+				<< report.nEngineVoices << " voices, buffers grown past that are not locked)" << endl;
+		else
+			wcout << "  Engine         not locked" << endl;
+		wcout << "  Note cache     " << (report.bCacheLocking ? "segments locked as they are rendered" : "not locked") << endl;
+	}
+	else
+		wcout << "  Memory lock    not requested" << endl;
+
+	if (config.bFlushDenormals)
+		wcout << "  Flush-to-zero  " << (report.bFlushToZero ? "on" : "OFF") << ", denormals-are-zero " << (report.bDenormalsAreZero ? "on" : "OFF") << endl;
+	else
+		wcout << "  Flush-to-zero  not requested" << endl;
+}
@@ -0,0 +1,237 @@
+/*
+	Recorder - streaming capture of the audio thread output
+
+	The audio thread hands every finished block to PushBlock(), which copies it
+	into a fixed size single-producer/single-consumer ring and returns at once.
+	A separate writer thread drains the ring, batches blocks into one large
+	buffer and writes it to disk sequentially. If the disk stalls and the ring
+	fills up, blocks are dropped (and counted) instead of ever blocking the
+	audio thread, so memory stays bounded no matter how long the session runs.
+
+	Output is 16/32 bit PCM WAV. The RIFF size fields are 32 bit, so they are
+	clamped once a recording passes 4 GB (~13 hours of 44.1 kHz mono 16 bit);
+	the sample data itself is still written in full.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <chrono>
+using namespace std;
+
+#include "RealTime.h"
+
+template<class T>
+class Recorder
+{
+public:
+	Recorder()
+	{
+		m_bRunning = false;
+		m_nBlockSamples = 0;
+		m_nRingBlocks = 0;
+		m_nWriteIndex = 0;
+		m_nReadIndex = 0;
+		m_nDroppedBlocks = 0;
+		m_nWrittenBlocks = 0;
+		m_nDataBytes = 0;
+	}
+
+	~Recorder()
+	{
+		Close();
+	}
+
+	// nRingBlocks is the amount of audio that can be buffered while the disk is
+	// busy, e.g. 256 blocks of 512 samples is ~3 seconds at 44.1 kHz.
+	bool Open(const string &sFileName, unsigned int nSampleRate, unsigned int nChannels, unsigned int nBlockSamples, unsigned int nRingBlocks = 256, unsigned int nWriteBlocks = 64)
+	{
+		Close();
+
+		m_file.open(sFileName, ios::out | ios::binary | ios::trunc);
+		if (!m_file.is_open())
+			return false;
+
+		m_nSampleRate = nSampleRate;
+		m_nChannels = nChannels;
+		m_nBlockSamples = nBlockSamples;
+		m_nRingBlocks = nRingBlocks;
+		m_nWriteBlocks = nWriteBlocks;
+		m_nWriteIndex = 0;
+		m_nReadIndex = 0;
+		m_nDroppedBlocks = 0;
+		m_nWrittenBlocks = 0;
+		m_nDataBytes = 0;
+
+		// All memory is allocated up front, nothing is allocated while recording
+		m_vecRing.assign((size_t)m_nRingBlocks * m_nBlockSamples, (T)0);
+		m_vecWriteBuffer.clear();
+		m_vecWriteBuffer.reserve((size_t)m_nWriteBlocks * m_nBlockSamples * sizeof(T));
+
+		WriteHeader();
+
+		m_bRunning = true;
+		m_thread = thread(&Recorder::WriterThread, this);
+		return true;
+	}
+
+	// Pins the ring the audio thread writes into, call after Open()
+	bool LockRing()
+	{
+		return !m_vecRing.empty() && LockMemory(&m_vecRing[0], m_vecRing.size() * sizeof(T));
+	}
+
+	// Stops the writer once everything already queued has reached the disk
+	void Close()
+	{
+		if (!m_thread.joinable())
+			return;
+
+		m_bRunning = false;
+		m_thread.join();
+
+		WriteHeader();
+		m_file.close();
+	}
+
+	// Called from the audio thread. Never blocks, never allocates.
+	bool PushBlock(const T *pBlock, unsigned int nSamples)
+	{
+		if (!m_bRunning || nSamples != m_nBlockSamples)
+			return false;
+
+		unsigned long long nWrite = m_nWriteIndex.load(memory_order_relaxed);
+		unsigned long long nRead = m_nReadIndex.load(memory_order_acquire);
+
+		if (nWrite - nRead >= m_nRingBlocks)
+		{
+			// Writer has fallen behind, lose this block rather than wait
+			m_nDroppedBlocks.fetch_add(1, memory_order_relaxed);
+			return false;
+		}
+
+		T *pSlot = &m_vecRing[(size_t)(nWrite % m_nRingBlocks) * m_nBlockSamples];
+		for (unsigned int n = 0; n < nSamples; n++)
+			pSlot[n] = pBlock[n];
+
+		m_nWriteIndex.store(nWrite + 1, memory_order_release);
+		return true;
+	}
+
+	bool IsRecording()
+	{
+		return m_bRunning;
+	}
+
+	unsigned long long GetDroppedBlocks()
+	{
+		return m_nDroppedBlocks;
+	}
+
+	unsigned long long GetWrittenBlocks()
+	{
+		return m_nWrittenBlocks;
+	}
+
+private:
+	unsigned int m_nSampleRate;
+	unsigned int m_nChannels;
+	unsigned int m_nBlockSamples;
+	unsigned int m_nRingBlocks;
+	unsigned int m_nWriteBlocks;
+
+	vector<T> m_vecRing;
+	vector<char> m_vecWriteBuffer;
+	ofstream m_file;
+	unsigned long long m_nDataBytes;
+
+	thread m_thread;
+	atomic<bool> m_bRunning;
+	atomic<unsigned long long> m_nWriteIndex;
+	atomic<unsigned long long> m_nReadIndex;
+	atomic<unsigned long long> m_nDroppedBlocks;
+	atomic<unsigned long long> m_nWrittenBlocks;
+
+	// Drains the ring into the write buffer, flushing it in large chunks
+	void WriterThread()
+	{
+		while (true)
+		{
+			// Read the flag before draining so nothing pushed before Close() is lost
+			bool bRunning = m_bRunning;
+			unsigned long long nRead = m_nReadIndex.load(memory_order_relaxed);
+			unsigned long long nWrite = m_nWriteIndex.load(memory_order_acquire);
+
+			while (nRead < nWrite)
+			{
+				const char *pSlot = (const char*)&m_vecRing[(size_t)(nRead % m_nRingBlocks) * m_nBlockSamples];
+				m_vecWriteBuffer.insert(m_vecWriteBuffer.end(), pSlot, pSlot + m_nBlockSamples * sizeof(T));
+
+				// Slot can be reused by the audio thread as soon as it is copied
+				nRead++;
+				m_nReadIndex.store(nRead, memory_order_release);
+				m_nWrittenBlocks++;
+
+				if (m_vecWriteBuffer.size() >= m_vecWriteBuffer.capacity())
+					Flush();
+			}
+
+			if (!bRunning)
+				break;
+
+			this_thread::sleep_for(chrono::milliseconds(5));
+		}
+
+		Flush();
+	}
+
+	void Flush()
+	{
+		if (m_vecWriteBuffer.empty())
+			return;
+
+		m_file.write(m_vecWriteBuffer.data(), m_vecWriteBuffer.size());
+		m_nDataBytes += m_vecWriteBuffer.size();
+		m_vecWriteBuffer.clear();
+
+		// Keep the sizes on disk current, so a killed or crashed session still
+		// leaves a playable file
+		WriteHeader();
+		m_file.flush();
+	}
+
+	void WriteLE(unsigned int nValue, int nBytes)
+	{
+		for (int i = 0; i < nBytes; i++)
+			m_file.put((char)((nValue >> (8 * i)) & 0xFF));
+	}
+
+	// Canonical 44 byte PCM header. Written with zero sizes on Open(), then
+	// rewritten with the sizes so far after every flush and on Close().
+	void WriteHeader()
+	{
+		const unsigned long long nMaxData = 0xFFFFFFFFull - 36;
+		unsigned int nDataBytes = (unsigned int)(m_nDataBytes > nMaxData ? nMaxData : m_nDataBytes);
+		unsigned int nBlockAlign = m_nChannels * sizeof(T);
+
+		m_file.seekp(0);
+		m_file.write("RIFF", 4);
+		WriteLE(36 + nDataBytes, 4);
+		m_file.write("WAVE", 4);
+		m_file.write("fmt ", 4);
+		WriteLE(16, 4);
+		WriteLE(1, 2);											// PCM
+		WriteLE(m_nChannels, 2);
+		WriteLE(m_nSampleRate, 4);
+		WriteLE(m_nSampleRate * nBlockAlign, 4);
+		WriteLE(nBlockAlign, 2);
+		WriteLE(sizeof(T) * 8, 2);
+		m_file.write("data", 4);
+		WriteLE(nDataBytes, 4);
+		m_file.seekp(0, ios::end);
+	}
+};
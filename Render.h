@@ -0,0 +1,208 @@
+/*
+	Render - headless rendering of note scripts through a synth::engine
+
+	A note script is a list of timed key presses and releases. render() plays
+	it into a buffer exactly as the audio thread would, but without a device
+	and as fast as the CPU allows, so it can drive regression checks and
+	offline batch work.
+
+	Requires FTYPE to be defined before inclusion.
+*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <algorithm>
+using namespace std;
+
+#include "Synth.h"
+
+namespace synth
+{
+	struct note_event
+	{
+		FTYPE dTime;		//Seconds from the start of the script
+		int nNoteID;
+		int nChannel;
+		bool bPressed;
+
+		note_event(FTYPE t = 0.0, int id = 0, int channel = 0, bool pressed = true)
+		{
+			dTime = t;
+			nNoteID = id;
+			nChannel = channel;
+			bPressed = pressed;
+		}
+	};
+
+	struct note_script
+	{
+		string sName;
+		vector<note_event> vecEvents;
+		FTYPE dDuration;		//Seconds to render, including release tails
+
+		note_script()
+		{
+			dDuration = 0.0;
+		}
+
+		//Convenience for building scripts, a held note from dOn to dOff
+		void hold(int nNoteID, int nChannel, FTYPE dOn, FTYPE dOff)
+		{
+			vecEvents.push_back(note_event(dOn, nNoteID, nChannel, true));
+			vecEvents.push_back(note_event(dOff, nNoteID, nChannel, false));
+		}
+	};
+
+	//Events are applied at the first sample at or after their time, and the
+	//sample clock is derived from an integer count as in olcNoiseMaker. The
+	//engine renders in blocks of up to nBlockSamples, split at events.
+	inline void render(engine &e, const note_script &script, vector<FTYPE> &vecOutput, unsigned int nBlockSamples = 512)
+	{
+		e.reset();
+
+		vector<note_event> vecEvents = script.vecEvents;
+		stable_sort(vecEvents.begin(), vecEvents.end(), [](note_event const& a, note_event const& b) { return a.dTime < b.dTime; });
+
+		size_t nSamples = (size_t)(script.dDuration * e.nSampleRate + 0.5);
+		double dTimeStep = 1.0 / (double)e.nSampleRate;
+		vecOutput.assign(nSamples, 0.0);
+
+		size_t nEvent = 0;
+		size_t n = 0;
+		while (n < nSamples)
+		{
+			FTYPE dTime = (FTYPE)((double)n * dTimeStep);
+			while (nEvent < vecEvents.size() && vecEvents[nEvent].dTime <= dTime)
+			{
+				const note_event &ev = vecEvents[nEvent++];
+				e.key(ev.nNoteID, ev.nChannel, ev.bPressed, dTime);
+			}
+
+			//Run up to the sample where the next event lands
+			size_t nEnd = (std::min)(n + nBlockSamples, nSamples);
+			if (nEvent < vecEvents.size())
+			{
+				size_t m = n + 1;
+				while (m < nEnd && (FTYPE)((double)m * dTimeStep) < vecEvents[nEvent].dTime)
+					m++;
+				nEnd = m;
+			}
+
+			e.render(n, &vecOutput[n], (unsigned int)(nEnd - n));
+			n = nEnd;
+		}
+	}
+
+	inline void write_le(ofstream &file, unsigned int nValue, int nBytes)
+	{
+		for (int i = 0; i < nBytes; i++)
+			file.put((char)((nValue >> (8 * i)) & 0xFF));
+	}
+
+	inline unsigned int read_le(const unsigned char *p, int nBytes)
+	{
+		unsigned int nValue = 0;
+		for (int i = 0; i < nBytes; i++)
+			nValue |= (unsigned int)p[i] << (8 * i);
+		return nValue;
+	}
+
+	//Mono 32 bit float WAV, lossless enough for references and playable anywhere
+	inline bool write_wav(const string &sFileName, const vector<FTYPE> &vecSamples, unsigned int nSampleRate)
+	{
+		ofstream file(sFileName, ios::out | ios::binary | ios::trunc);
+		if (!file.is_open())
+			return false;
+
+		unsigned int nDataBytes = (unsigned int)(vecSamples.size() * 4);
+		file.write("RIFF", 4);
+		write_le(file, 36 + nDataBytes, 4);
+		file.write("WAVE", 4);
+		file.write("fmt ", 4);
+		write_le(file, 16, 4);
+		write_le(file, 3, 2);					//IEEE float
+		write_le(file, 1, 2);
+		write_le(file, nSampleRate, 4);
+		write_le(file, nSampleRate * 4, 4);
+		write_le(file, 4, 2);
+		write_le(file, 32, 2);
+		file.write("data", 4);
+		write_le(file, nDataBytes, 4);
+
+		vector<float> vecData(vecSamples.begin(), vecSamples.end());
+		vector<char> vecBytes(nDataBytes);
+		for (size_t n = 0; n < vecData.size(); n++)
+		{
+			unsigned int nBits;
+			memcpy(&nBits, &vecData[n], 4);
+			for (int i = 0; i < 4; i++)
+				vecBytes[n * 4 + i] = (char)((nBits >> (8 * i)) & 0xFF);
+		}
+		file.write(vecBytes.data(), vecBytes.size());
+
+		return file.good();
+	}
+
+	//Reads back what write_wav() produces, mono 32 bit float or 16 bit PCM
+	inline bool read_wav(const string &sFileName, vector<FTYPE> &vecSamples, unsigned int &nSampleRate)
+	{
+		ifstream file(sFileName, ios::in | ios::binary);
+		if (!file.is_open())
+			return false;
+
+		vector<unsigned char> vecFile((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+		if (vecFile.size() < 12 || memcmp(&vecFile[0], "RIFF", 4) != 0 || memcmp(&vecFile[8], "WAVE", 4) != 0)
+			return false;
+
+		unsigned int nFormat = 0, nBits = 0;
+		size_t nPos = 12;
+		while (nPos + 8 <= vecFile.size())
+		{
+			unsigned int nChunk = read_le(&vecFile[nPos + 4], 4);
+			const unsigned char *pChunk = &vecFile[nPos + 8];
+			if (nPos + 8 + nChunk > vecFile.size())
+				return false;
+
+			if (memcmp(&vecFile[nPos], "fmt ", 4) == 0 && nChunk >= 16)
+			{
+				nFormat = read_le(pChunk, 2);
+				nSampleRate = read_le(pChunk + 4, 4);
+				nBits = read_le(pChunk + 14, 2);
+				if (read_le(pChunk + 2, 2) != 1)
+					return false;
+			}
+			else if (memcmp(&vecFile[nPos], "data", 4) == 0)
+			{
+				vecSamples.clear();
+				if (nFormat == 3 && nBits == 32)
+				{
+					for (size_t n = 0; n + 4 <= nChunk; n += 4)
+					{
+						unsigned int nValue = read_le(pChunk + n, 4);
+						float fSample;
+						memcpy(&fSample, &nValue, 4);
+						vecSamples.push_back(fSample);
+					}
+				}
+				else if (nFormat == 1 && nBits == 16)
+				{
+					for (size_t n = 0; n + 2 <= nChunk; n += 2)
+						vecSamples.push_back((FTYPE)(short)read_le(pChunk + n, 2) / 32767.0);
+				}
+				else
+					return false;
+
+				return true;
+			}
+
+			nPos += 8 + nChunk + (nChunk & 1);
+		}
+
+		return false;
+	}
+}
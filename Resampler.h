@@ -0,0 +1,249 @@
+/*
+	Resampler - rational polyphase sample rate conversion
+
+	Lets an instrument with little high frequency content render at a lower
+	internal rate and be converted to the output rate once, on its bus,
+	instead of every oscillator running at the full rate.
+
+	For a ratio of nUp/nDown the signal is conceptually zero-stuffed by nUp,
+	low-passed and kept every nDown samples. Only the kept samples are ever
+	computed: output k reads input floor(k * nDown / nUp) and older through
+	phase (k * nDown) % nUp of the filter, so each output costs one short
+	dot product whatever the ratio. The prototype is a Kaiser windowed sinc
+	cut at 0.45 of the lower of the two rates, about 90 dB down in the stop
+	band with the default 64 taps per phase.
+
+	Ratios needing more than MAX_PHASES phases (44.1 kHz to 44.101 kHz reduces
+	to 44101) would need a table of millions of coefficients, so they keep
+	INTERPOLATED_PHASES evenly spaced phases of the same filter instead and
+	each output blends the two either side of its exact phase. The sample
+	positions stay exact, only the filter phase is interpolated.
+
+	Tables depend only on the reduced ratio and the tap count, so they are
+	built once and shared by every resampler converting between the same
+	rates, on any thread, and freed with the last of them.
+
+	The filter is linear phase, output lags input by delay() output samples.
+
+	Requires FTYPE to be defined before inclusion.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <mutex>
+using namespace std;
+
+#include "Oversampler.h"
+
+namespace synth
+{
+	// Coefficient tables by (nUp, nDown, nTaps). Static members of a class
+	// template so the header can define them, and they are constructed before
+	// main() rather than on first use from several threads at once.
+	template<class T>
+	struct resampler_tables
+	{
+		static mutex muxTables;
+		static map<tuple<int, int, int>, weak_ptr<const vector<T>>> mapTables;
+	};
+
+	template<class T> mutex resampler_tables<T>::muxTables;
+	template<class T> map<tuple<int, int, int>, weak_ptr<const vector<T>>> resampler_tables<T>::mapTables;
+
+	struct resampler
+	{
+		static const int MAX_PHASES = 1024;				// Largest exact table, in phases
+		static const int INTERPOLATED_PHASES = 512;		// Phases kept when the ratio needs more
+
+		unsigned int nInRate;
+		unsigned int nOutRate;
+		int nUp;
+		int nDown;
+		int nTaps;						// Per phase
+		int nPhases;					// nUp when exact, else INTERPOLATED_PHASES
+		shared_ptr<const vector<FTYPE>> pCoeff;	// Phases of nTaps, newest input first, plus a closing one when interpolated
+		vector<FTYPE> vecHistory;		// Input delay line, stored twice so the window is contiguous
+		int nPos;
+		unsigned long long nNextOutput;
+		unsigned long long nNextInput;
+
+		resampler()
+		{
+			init(44100, 44100);
+		}
+
+		// Ratios are reduced to lowest terms, so the phase count is the output
+		// rate over the common divisor (160 for 44.1 kHz to 48 kHz)
+		void init(unsigned int nInputRate, unsigned int nOutputRate, int nTapsPerPhase = 64)
+		{
+			unsigned int a = nInputRate, b = nOutputRate;
+			while (b != 0)
+			{
+				unsigned int r = a % b;
+				a = b;
+				b = r;
+			}
+
+			nInRate = nInputRate;
+			nOutRate = nOutputRate;
+			nUp = (int)(nOutputRate / a);
+			nDown = (int)(nInputRate / a);
+
+			// When decimating the transition band is set by the output rate, so the filter grows
+			nTaps = nTapsPerPhase * (nDown > nUp ? (nDown + nUp - 1) / nUp : 1);
+			nPhases = nUp <= MAX_PHASES ? nUp : INTERPOLATED_PHASES;
+
+			unique_lock<mutex> lm(resampler_tables<FTYPE>::muxTables);
+			weak_ptr<const vector<FTYPE>> &pShared = resampler_tables<FTYPE>::mapTables[make_tuple(nUp, nDown, nTaps)];
+			pCoeff = pShared.lock();
+			if (!pCoeff)
+			{
+				pCoeff = build_table(nUp, nDown, nTaps, nPhases);
+				pShared = pCoeff;
+			}
+			lm.unlock();
+
+			seek(0);
+		}
+
+		// Kaiser windowed sinc at x zero-stuffed samples from the centre of a
+		// filter nUp * nTaps long, zero past its ends
+		static double kernel(double x, double dCentre, double dCutoff)
+		{
+			const double dBeta = 9.0;
+			double r = x / (dCentre + 1.0);
+			if (r <= -1.0 || r >= 1.0)
+				return 0.0;
+
+			double dSinc = x == 0.0 ? 2.0 * dCutoff : sin(2.0 * PI * dCutoff * x) / (PI * x);
+			return dSinc * bessel_i0(dBeta * sqrt(1.0 - r * r)) / bessel_i0(dBeta);
+		}
+
+		static shared_ptr<const vector<FTYPE>> build_table(int nUp, int nDown, int nTaps, int nPhases)
+		{
+			// Prototype at the zero-stuffed rate, one tap short so the centre
+			// falls on a whole sample and the delay is exact for integer ratios
+			int nLength = nUp * nTaps - 1;
+			double dCentre = (nLength - 1) / 2.0;
+			double dCutoff = 0.45 * (std::min)(nUp, nDown) / ((double)nDown * nUp);
+
+			shared_ptr<vector<FTYPE>> pTable;
+			if (nPhases == nUp)
+			{
+				vector<double> vecPrototype(nUp * nTaps, 0.0);
+				double dSum = 0.0;
+				for (int n = 0; n < nLength; n++)
+				{
+					vecPrototype[n] = kernel(n - dCentre, dCentre, dCutoff);
+					dSum += vecPrototype[n];
+				}
+
+				// Zero-stuffing loses a factor of nUp in level, put it back
+				pTable = make_shared<vector<FTYPE>>(nUp * nTaps, 0.0);
+				for (int p = 0; p < nUp; p++)
+					for (int j = 0; j < nTaps; j++)
+						(*pTable)[p * nTaps + j] = (FTYPE)(vecPrototype[p + j * nUp] * nUp / dSum);
+			}
+			else
+			{
+				// Phase q sits at q / nPhases of the way to the next input sample,
+				// the closing phase nPhases lets the last interval blend too. Each
+				// is scaled to unity gain on its own.
+				pTable = make_shared<vector<FTYPE>>((size_t)(nPhases + 1) * nTaps, 0.0);
+				vector<double> vecPhase(nTaps);
+				for (int q = 0; q <= nPhases; q++)
+				{
+					double p = (double)q * nUp / nPhases;
+					double dSum = 0.0;
+					for (int j = 0; j < nTaps; j++)
+					{
+						vecPhase[j] = kernel(p + (double)j * nUp - dCentre, dCentre, dCutoff);
+						dSum += vecPhase[j];
+					}
+					for (int j = 0; j < nTaps; j++)
+						(*pTable)[(size_t)q * nTaps + j] = (FTYPE)(vecPhase[j] / dSum);
+				}
+			}
+
+			return pTable;
+		}
+
+		bool is_identity()
+		{
+			return nUp == nDown;
+		}
+
+		// Output samples behind the input
+		double delay()
+		{
+			return ((double)nUp * nTaps - 2.0) / 2.0 / nDown;
+		}
+
+		// Restarts the stream at output sample nOutput, primed from the nTaps
+		// input samples before it
+		void seek(unsigned long long nOutput)
+		{
+			vecHistory.assign(nTaps * 2, 0.0);
+			nPos = 0;
+			nNextOutput = nOutput;
+
+			unsigned long long nFirst = nOutput * nDown / nUp;
+			nNextInput = nFirst >= (unsigned long long)nTaps ? nFirst + 1 - nTaps : 0;
+		}
+
+		void reset()
+		{
+			seek(0);
+		}
+
+		// Input samples the next nOutput outputs consume, starting at input sample nNextInput
+		unsigned int input_needed(unsigned int nOutput)
+		{
+			if (nOutput == 0)
+				return 0;
+
+			unsigned long long nLast = (nNextOutput + nOutput - 1) * nDown / nUp;
+			return nLast + 1 > nNextInput ? (unsigned int)(nLast + 1 - nNextInput) : 0;
+		}
+
+		// Adds nOutput samples to pOutput, reading exactly input_needed(nOutput) from pInput
+		void process(const FTYPE *pInput, FTYPE *pOutput, unsigned int nOutput)
+		{
+			unsigned int i = 0;
+			for (unsigned int k = 0; k < nOutput; k++)
+			{
+				unsigned long long nPhase = (nNextOutput + k) * nDown;
+				unsigned long long nInput = nPhase / nUp;
+
+				while (nNextInput <= nInput)
+				{
+					nPos = (nPos == 0 ? nTaps : nPos) - 1;
+					vecHistory[nPos] = pInput[i];
+					vecHistory[nPos + nTaps] = pInput[i];
+					i++;
+					nNextInput++;
+				}
+
+				const FTYPE *pHistory = &vecHistory[nPos];
+				if (nPhases == nUp)
+					pOutput[k] += dot(pHistory, &(*pCoeff)[(size_t)(nPhase % nUp) * nTaps], nTaps);
+				else
+				{
+					double dPhase = (double)(nPhase % nUp) * nPhases / nUp;
+					int q = (int)dPhase;
+					const FTYPE *pRow = &(*pCoeff)[(size_t)q * nTaps];
+					FTYPE y0 = dot(pHistory, pRow, nTaps);
+					FTYPE y1 = dot(pHistory, pRow + nTaps, nTaps);
+					pOutput[k] += y0 + (FTYPE)(dPhase - q) * (y1 - y0);
+				}
+			}
+
+			nNextOutput += nOutput;
+		}
+	};
+}
@@ -0,0 +1,381 @@
+/*
+	SharedRing - output ring in shared memory for other local processes
+
+	The audio thread copies each finished block into a named file mapping
+	once, and any number of reader processes (meters, recorders, streamers)
+	read it from there without sockets and without ever making the writer
+	wait. There is no POSIX shm_open() on Windows, so the ring lives in a
+	pagefile-backed section from CreateFileMapping(), which is the same thing.
+
+	Layout, all fields little endian:
+
+		0	SharedRingHeader (format, capacity, write cursor)
+		128	nCapacityFrames * nChannels samples
+
+	The only things that change after creation are two frame counts. The
+	writer raises nReserveFrames, copies a block in, then raises nWriteFrames
+	to match. A reader keeps its own cursor and copies out whatever lies
+	between it and nWriteFrames, then checks nReserveFrames to see whether
+	the writer has come round and overwritten any of it in the meantime. A
+	reader that falls more than a ring behind has lost data, it notices,
+	counts the loss and skips forward.
+	Readers never write to the mapping, so a slow or crashed reader cannot
+	affect the writer or the other readers.
+*/
+
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <type_traits>
+#include <emmintrin.h>
+using namespace std;
+
+#include <Windows.h>
+#include "RealTime.h"
+
+#pragma pack(push, 8)
+struct SharedRingHeader
+{
+	unsigned int nMagic;			// SHARED_RING_MAGIC once the writer has filled in the header
+	unsigned int nVersion;
+	unsigned int nHeaderBytes;		// Offset of the first sample
+	unsigned int nSampleRate;
+	unsigned int nChannels;
+	unsigned int nFormat;			// WAVE format tag, 1 PCM or 3 IEEE float
+	unsigned int nBitsPerSample;
+	unsigned int nCapacityFrames;	// Power of two
+	unsigned int nUnused[8];
+
+	// Own cache line, the only fields written while running
+	volatile LONGLONG nWriteFrames;		// Frames readable, ever since creation
+	volatile LONGLONG nReserveFrames;	// Frames the writer may be overwriting up to
+	LONGLONG nPadding[6];
+};
+#pragma pack(pop)
+
+const unsigned int SHARED_RING_MAGIC = 0x474E5253;	// "SRNG"
+const unsigned int SHARED_RING_VERSION = 1;
+const unsigned int SHARED_RING_HEADER_BYTES = 128;
+
+template<class T>
+class SharedRingWriter
+{
+public:
+	SharedRingWriter()
+	{
+		m_hMapping = nullptr;
+		m_pHeader = nullptr;
+		m_pSamples = nullptr;
+		m_nMask = 0;
+		m_nChannels = 0;
+		m_bLocked = false;
+	}
+
+	~SharedRingWriter()
+	{
+		Close();
+	}
+
+	// sName follows kernel object naming, e.g. L"Local\\Synthesizer". The
+	// capacity is rounded up to a power of two frames, 32768 is ~0.7 seconds
+	// at 44.1 kHz for readers to be late by before they lose data.
+	bool Create(const wstring &sName, unsigned int nSampleRate, unsigned int nChannels, unsigned int nCapacityFrames = 32768)
+	{
+		Close();
+
+		unsigned int nFrames = 1;
+		while (nFrames < nCapacityFrames)
+			nFrames <<= 1;
+
+		unsigned long long nBytes = SHARED_RING_HEADER_BYTES + (unsigned long long)nFrames * nChannels * sizeof(T);
+		m_hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)(nBytes >> 32), (DWORD)nBytes, sName.c_str());
+		if (m_hMapping == nullptr)
+			return false;
+
+		// Someone else already owns a ring of this name
+		if (GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			Close();
+			return false;
+		}
+
+		void *pView = MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)nBytes);
+		if (pView == nullptr)
+		{
+			Close();
+			return false;
+		}
+
+		// Pages of a new section are zeroed, so a reader sees no magic until the header is complete
+		m_pHeader = (SharedRingHeader*)pView;
+		m_pSamples = (T*)((char*)pView + SHARED_RING_HEADER_BYTES);
+		m_nMask = nFrames - 1;
+		m_nChannels = nChannels;
+		m_bLocked = LockMemory(pView, (SIZE_T)nBytes);
+
+		m_pHeader->nVersion = SHARED_RING_VERSION;
+		m_pHeader->nHeaderBytes = SHARED_RING_HEADER_BYTES;
+		m_pHeader->nSampleRate = nSampleRate;
+		m_pHeader->nChannels = nChannels;
+		m_pHeader->nFormat = is_floating_point<T>::value ? 3 : 1;
+		m_pHeader->nBitsPerSample = sizeof(T) * 8;
+		m_pHeader->nCapacityFrames = nFrames;
+		InterlockedExchange64(&m_pHeader->nWriteFrames, 0);
+		InterlockedExchange64(&m_pHeader->nReserveFrames, 0);
+		InterlockedExchange((volatile LONG*)&m_pHeader->nMagic, (LONG)SHARED_RING_MAGIC);
+		return true;
+	}
+
+	void Close()
+	{
+		if (m_pHeader != nullptr)
+			UnmapViewOfFile(m_pHeader);
+		if (m_hMapping != nullptr)
+			CloseHandle(m_hMapping);
+
+		m_hMapping = nullptr;
+		m_pHeader = nullptr;
+		m_pSamples = nullptr;
+		m_bLocked = false;
+	}
+
+	// Called from the audio thread. Never blocks, never allocates.
+	bool PushBlock(const T *pBlock, unsigned int nSamples)
+	{
+		if (m_pHeader == nullptr)
+			return false;
+
+		LONGLONG nWrite = m_pHeader->nWriteFrames;
+		unsigned int nFrames = nSamples / m_nChannels;
+		InterlockedExchange64(&m_pHeader->nReserveFrames, nWrite + nFrames);
+		for (unsigned int f = 0; f < nFrames; f++)
+		{
+			T *pFrame = &m_pSamples[(size_t)((nWrite + f) & m_nMask) * m_nChannels];
+			for (unsigned int c = 0; c < m_nChannels; c++)
+				pFrame[c] = pBlock[f * m_nChannels + c];
+		}
+
+		// Full barrier, the samples are visible before the cursor that covers them
+		InterlockedExchange64(&m_pHeader->nWriteFrames, nWrite + nFrames);
+		return true;
+	}
+
+	bool IsOpen()
+	{
+		return m_pHeader != nullptr;
+	}
+
+	// The view is locked when created, so the audio thread never page faults on it
+	bool IsLocked()
+	{
+		return m_bLocked;
+	}
+
+private:
+	HANDLE m_hMapping;
+	SharedRingHeader *m_pHeader;
+	T *m_pSamples;
+	unsigned long long m_nMask;
+	unsigned int m_nChannels;
+	bool m_bLocked;
+};
+
+template<class T>
+class SharedRingReader
+{
+public:
+	SharedRingReader()
+	{
+		m_hMapping = nullptr;
+		m_pHeader = nullptr;
+		m_pSamples = nullptr;
+		m_nReadFrames = 0;
+		m_nLostFrames = 0;
+	}
+
+	~SharedRingReader()
+	{
+		Close();
+	}
+
+	// Fails if there is no such ring yet or its sample format is not T.
+	// Reading starts at the writer's current position.
+	bool Open(const wstring &sName)
+	{
+		Close();
+
+		m_hMapping = OpenFileMappingW(FILE_MAP_READ, FALSE, sName.c_str());
+		if (m_hMapping == nullptr)
+			return false;
+
+		// Size 0 maps the whole section
+		void *pView = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+		if (pView == nullptr)
+		{
+			Close();
+			return false;
+		}
+		m_pHeader = (const SharedRingHeader*)pView;
+
+		unsigned int nMagic = *(volatile const unsigned int*)&m_pHeader->nMagic;
+		atomic_signal_fence(memory_order_acquire);
+		bool bValid = nMagic == SHARED_RING_MAGIC
+			&& m_pHeader->nVersion == SHARED_RING_VERSION
+			&& m_pHeader->nBitsPerSample == sizeof(T) * 8
+			&& m_pHeader->nFormat == (is_floating_point<T>::value ? 3u : 1u);
+		if (!bValid)
+		{
+			Close();
+			return false;
+		}
+
+		m_pSamples = (const T*)((const char*)pView + m_pHeader->nHeaderBytes);
+		m_nReadFrames = WriteFrames();
+		m_nLostFrames = 0;
+		return true;
+	}
+
+	void Close()
+	{
+		if (m_pHeader != nullptr)
+			UnmapViewOfFile(m_pHeader);
+		if (m_hMapping != nullptr)
+			CloseHandle(m_hMapping);
+
+		m_hMapping = nullptr;
+		m_pHeader = nullptr;
+		m_pSamples = nullptr;
+	}
+
+	// Copies up to nMaxFrames interleaved frames, returns how many. Returns 0
+	// when nothing new has been written, it never waits.
+	unsigned int Read(T *pOutput, unsigned int nMaxFrames)
+	{
+		if (m_pHeader == nullptr)
+			return 0;
+
+		unsigned long long nCapacity = m_pHeader->nCapacityFrames;
+		unsigned int nChannels = m_pHeader->nChannels;
+		long long nWrite = WriteFrames();
+
+		// The writer started again, follow it from its new position
+		if (nWrite < m_nReadFrames)
+			m_nReadFrames = nWrite;
+
+		// Lapped, the oldest frames have been overwritten already
+		if ((unsigned long long)(nWrite - m_nReadFrames) > nCapacity)
+			Skip(nWrite - (long long)nCapacity / 2);
+
+		unsigned int nFrames = (unsigned int)(std::min)((long long)nMaxFrames, nWrite - m_nReadFrames);
+		for (unsigned int f = 0; f < nFrames; f++)
+		{
+			const T *pFrame = &m_pSamples[(size_t)((m_nReadFrames + f) & (nCapacity - 1)) * nChannels];
+			for (unsigned int c = 0; c < nChannels; c++)
+				pOutput[f * nChannels + c] = pFrame[c];
+		}
+
+		// The writer may have come round to the copied frames while they were read
+		long long nReserve = Load(&m_pHeader->nReserveFrames);
+		if ((unsigned long long)(nReserve - m_nReadFrames) > nCapacity)
+		{
+			Skip(nReserve - (long long)nCapacity / 2);
+			return 0;
+		}
+
+		m_nReadFrames += nFrames;
+		return nFrames;
+	}
+
+	// Frames written but not yet read
+	long long GetLag()
+	{
+		return m_pHeader != nullptr ? WriteFrames() - m_nReadFrames : 0;
+	}
+
+	unsigned long long GetLostFrames()
+	{
+		return m_nLostFrames;
+	}
+
+	const SharedRingHeader *GetHeader()
+	{
+		return m_pHeader;
+	}
+
+private:
+	HANDLE m_hMapping;
+	const SharedRingHeader *m_pHeader;
+	const T *m_pSamples;
+	long long m_nReadFrames;
+	unsigned long long m_nLostFrames;
+
+	// The view is read only, so no interlocked read (it would write). An
+	// aligned 8 byte SSE load is atomic on 32 bit x86 too, and x86 never
+	// reorders loads with other loads, so only the compiler needs fencing.
+	long long Load(volatile const LONGLONG *pValue)
+	{
+		long long nValue;
+		atomic_signal_fence(memory_order_seq_cst);
+		_mm_storel_epi64((__m128i*)&nValue, _mm_loadl_epi64((const __m128i*)pValue));
+		atomic_signal_fence(memory_order_seq_cst);
+		return nValue;
+	}
+
+	long long WriteFrames()
+	{
+		return Load(&m_pHeader->nWriteFrames);
+	}
+
+	void Skip(long long nFrame)
+	{
+		m_nLostFrames += nFrame - m_nReadFrames;
+		m_nReadFrames = nFrame;
+	}
+};
+
+// Small reader for checking a ring from another process: prints the level and
+// how far behind the reader is, ten times a second, until the process is killed
+template<class T>
+int RunSharedRingMeter(const wstring &sName)
+{
+	SharedRingReader<T> reader;
+	if (!reader.Open(sName))
+	{
+		wcout << "No " << sizeof(T) * 8 << " bit shared ring named " << sName << endl;
+		return 1;
+	}
+
+	const SharedRingHeader *pHeader = reader.GetHeader();
+	wcout << sName << ": " << pHeader->nSampleRate << " Hz, " << pHeader->nChannels << " channel(s), "
+		<< pHeader->nBitsPerSample << " bit, " << pHeader->nCapacityFrames << " frames" << endl;
+
+	double dFullScale = is_floating_point<T>::value ? 1.0 : (double)((1ull << (sizeof(T) * 8 - 1)) - 1);
+	vector<T> vecFrames(4096 * pHeader->nChannels);
+	while (true)
+	{
+		double dPeak = 0.0;
+		unsigned long long nFrames = 0;
+		for (int nPoll = 0; nPoll < 10; nPoll++)
+		{
+			unsigned int nRead;
+			while ((nRead = reader.Read(&vecFrames[0], 4096)) > 0)
+			{
+				for (size_t i = 0; i < (size_t)nRead * pHeader->nChannels; i++)
+					dPeak = (std::max)(dPeak, fabs((double)vecFrames[i]) / dFullScale);
+				nFrames += nRead;
+			}
+			Sleep(10);
+		}
+
+		wcout << "\rPeak " << fixed << setprecision(1) << setw(6) << (dPeak > 0.0 ? 20.0 * log10(dPeak) : -99.9) << " dBFS"
+			<< "  Frames " << setw(6) << nFrames << "  Lag " << setw(6) << reader.GetLag() << "  Lost " << reader.GetLostFrames() << "    ";
+	}
+
+	return 0;
+}
@@ -0,0 +1,1469 @@
+/*
+	Synth - oscillators, envelopes, instruments and the voice mixing engine
+
+	Everything needed to turn notes into samples, with no dependency on the
+	audio device, so it can also be driven headless (see Render.h).
+
+	Requires FTYPE to be defined before inclusion.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <list>
+#include <map>
+#include <tuple>
+#include <memory>
+#include <mutex>
+#include <climits>
+#include <algorithm>
+#include <emmintrin.h>
+using namespace std;
+
+namespace synth
+{
+	const double PI = 2.0 * acos(0.0);
+}
+
+#include "Oversampler.h"
+#include "Resampler.h"
+
+namespace synth
+{
+	FTYPE w(FTYPE dHerz)		//Converts frequency(Hz) to angular velocity
+	{
+		return dHerz * 2.0 * PI;
+	}
+
+	struct note			//A basic note
+	{
+		int id;			//Position in scale
+		FTYPE on;		//Time note was activated
+		FTYPE off;		//Time note was deactivated
+		bool active;
+		int channel;
+
+		shared_ptr<const vector<FTYPE>> cache;		//Pre-rendered attack/decay, see note_cache
+		long long nCacheStart;		//Bus sample the cached segment starts at
+		long long nLiveFrom;		//Bus sample where playback crossfades from the cache to live
+		unsigned int nCachePatch;	//Patch version the cached segment was rendered with
+
+		note()
+		{
+			id = 0;
+			on = 0.0;
+			off = 0.0;
+			active = false;
+			channel = 0;
+			nCacheStart = 0;
+			nLiveFrom = LLONG_MAX;
+			nCachePatch = 0;
+		}
+	};
+
+	const int OSC_SINE = 0;
+	const int OSC_SQUARE = 1;
+	const int OSC_TRIANGLE = 2;
+	const int OSC_SAW_AN = 3;
+	const int OSC_SAW_OP = 4;
+	const int OSC_NOISE = 5;
+
+	FTYPE osc(FTYPE dHertz, FTYPE dTime, int Type = OSC_SINE, FTYPE dLFOHertz = 0.0, FTYPE dLFOAmplitude = 0.0)
+	{
+		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * sin(w(dLFOHertz) * dTime);			//base frequency
+
+		switch (Type)
+		{
+		case OSC_SINE:		//Sine wave
+			return sin(dFreq);
+
+		case OSC_SQUARE:		//Sqare wave
+			return sin(dFreq) > 0.0 ? 1.0 : -1.0;
+
+		case OSC_TRIANGLE:		//Triangle wave
+			return asin(sin(dFreq)) * (2.0 / PI);
+
+		case OSC_SAW_AN:		//Saw wave (analogue / warm / slow)
+		{
+			FTYPE dOutput = 0.0;
+
+			for (FTYPE n = 1.0; n < 10.0; n++)
+				dOutput += (sin(n * dFreq)) / n;
+
+			return dOutput * (2.0 / PI);
+		}
+
+		case OSC_SAW_OP:		//Saw wave (optimized / harsh / fast)
+			return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+
+		case OSC_NOISE:		//Pseudo Random Noise
+			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+
+		default:
+			return 0.0;
+		}
+	}
+
+	//Counter for a stream of hashed noise at sample nSample. Each voice and partial
+	//has its own stream and every sample hashes its own count, so renders are
+	//repeatable whatever order voices are visited in and however the timeline is
+	//split into blocks.
+	inline unsigned int noise_seed(unsigned int nVoice, unsigned int nPartial, unsigned long long nSample)
+	{
+		unsigned long long h = ((unsigned long long)nVoice << 32) ^ nPartial;
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDull;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 33;
+		return (unsigned int)(h + nSample);
+	}
+
+	inline unsigned int noise_hash(unsigned int n)
+	{
+		n ^= n >> 16;
+		n *= 0x7FEB352Du;
+		n ^= n >> 15;
+		n *= 0x846CA68Bu;
+		n ^= n >> 16;
+		return n;
+	}
+
+	const int SCALE_DEFAULT = 0;
+
+	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
+	{
+		switch (nScaleID)
+		{
+		case SCALE_DEFAULT: default:
+			return 256 * pow(1.0594630943592952645618252949463, nNoteID);
+		}
+	}
+
+	struct envelope
+	{
+		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
+	};
+
+	struct envelope_adsr : public envelope
+	{
+		FTYPE dAttackTime;
+		FTYPE dDecayTime;
+		FTYPE dReleaseTime;
+		FTYPE dSustainAmplitude;
+		FTYPE dStartAmplitude;
+
+		envelope_adsr()
+		{
+			dAttackTime = 0.001;
+			dDecayTime = 1.0;
+			dStartAmplitude = 1.0;
+			dSustainAmplitude = 0.0;
+			dReleaseTime = 1.0;
+		}
+
+		//Times where the envelope may change segment, it is linear in between
+		int breakpoints(const FTYPE dTimeOn, const FTYPE dTimeOff, FTYPE *pTimes)
+		{
+			pTimes[0] = dTimeOn;
+			pTimes[1] = dTimeOn + dAttackTime;
+			pTimes[2] = dTimeOn + dAttackTime + dDecayTime;
+			pTimes[3] = dTimeOff;
+			pTimes[4] = dTimeOff + dReleaseTime;
+			return 5;
+		}
+
+		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
+		{
+			FTYPE dAmplitude = 0.0;
+			FTYPE dReleaseAmplitude = 0.0;
+
+			if (dTimeOn > dTimeOff)			//Note is on
+			{
+				FTYPE dLifeTime = dTime - dTimeOn;
+
+				// ASD
+				//Attack
+				if (dLifeTime <= dAttackTime)
+					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+
+				//Decay
+				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+				//Sustain
+				if (dLifeTime > (dAttackTime + dDecayTime))
+					dAmplitude = dSustainAmplitude;
+			}
+
+			else		//Note is off
+			{
+				FTYPE dLifeTime = dTimeOff - dTimeOn;
+
+				if (dLifeTime <= dAttackTime)
+					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
+
+				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+
+				if (dLifeTime > (dAttackTime + dDecayTime))
+					dReleaseAmplitude = dSustainAmplitude;
+
+				//Release
+				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+			}
+
+			if (dAmplitude <= 0.000)
+				dAmplitude = 0.0;
+
+
+			return dAmplitude;
+		}
+	};
+
+	FTYPE env(const FTYPE dTime, envelope &env, const FTYPE dTimeOn, const FTYPE dTimeOff)
+	{
+		return env.amplitude(dTime, dTimeOn, dTimeOff);
+	}
+
+	struct partial			//One oscillator of an instrument voice
+	{
+		int nWave;
+		int nNoteOffset;		//Semitones above the played note
+		FTYPE dGain;
+		FTYPE dLFOHertz;
+		FTYPE dLFOAmplitude;
+
+		partial(int wave = OSC_SINE, int offset = 0, FTYPE gain = 1.0, FTYPE lfoHertz = 0.0, FTYPE lfoAmplitude = 0.0)
+		{
+			nWave = wave;
+			nNoteOffset = offset;
+			dGain = gain;
+			dLFOHertz = lfoHertz;
+			dLFOAmplitude = lfoAmplitude;
+		}
+	};
+
+	//Branch free sine for x in [-PI, PI], within 1e-9 of sin()
+	inline FTYPE fast_sin(FTYPE x)
+	{
+		x = x > PI / 2.0 ? PI - x : x;
+		x = x < -PI / 2.0 ? -PI - x : x;
+		FTYPE x2 = x * x;
+		return x * (1.0 + x2 * (-1.0 / 6.0 + x2 * (1.0 / 120.0 + x2 * (-1.0 / 5040.0 + x2 * (1.0 / 362880.0 + x2 * (-1.0 / 39916800.0 + x2 * (1.0 / 6227020800.0)))))));
+	}
+
+	inline FTYPE wrap_phase(FTYPE x)		//Into [-PI, PI]
+	{
+		return x - 2.0 * PI * floor(x / (2.0 * PI) + 0.5);
+	}
+
+	//One sample of a phase kept in [-PI, PI], increments are at most a turn
+	inline FTYPE advance_phase(FTYPE dPhase, FTYPE dIncrement)
+	{
+		dPhase += dIncrement;
+		dPhase = dPhase > PI ? dPhase - 2.0 * PI : dPhase;
+		return dPhase < -PI ? dPhase + 2.0 * PI : dPhase;
+	}
+
+	//Waveforms as functions of a wrapped phase, matching osc()
+	template<int WAVE>
+	inline FTYPE wave(FTYPE x, unsigned int &nNoise)
+	{
+		switch (WAVE)
+		{
+		case OSC_SINE:
+			return fast_sin(x);
+
+		case OSC_SQUARE:
+			return x > 0.0 && x < PI ? 1.0 : -1.0;
+
+		case OSC_TRIANGLE:
+			x = x > PI / 2.0 ? PI - x : x;
+			x = x < -PI / 2.0 ? -PI - x : x;
+			return x * (2.0 / PI);
+
+		case OSC_SAW_AN:
+		{
+			FTYPE dOutput = 0.0;
+			for (int n = 1; n < 10; n++)
+				dOutput += fast_sin(wrap_phase(n * x)) / n;
+			return dOutput * (2.0 / PI);
+		}
+
+		case OSC_NOISE:		//Hashed sample count, see noise_seed()
+			return 2.0 * ((FTYPE)noise_hash(nNoise++) / 4294967295.0) - 1.0;
+
+		default:
+			return 0.0;
+		}
+	}
+
+	//SSE2 counterparts of advance_phase() and wave(), two lanes per register. The
+	//ternaries become a compare and a masked select so every lane runs the same
+	//instructions, and the arithmetic is in the same order, so results match the
+	//scalar versions bit for bit.
+	inline __m128d select_pd(__m128d vMask, __m128d vTrue, __m128d vFalse)
+	{
+		return _mm_or_pd(_mm_and_pd(vMask, vTrue), _mm_andnot_pd(vMask, vFalse));
+	}
+
+	inline __m128d advance_phase(__m128d vPhase, __m128d vIncrement)
+	{
+		const __m128d vPi = _mm_set1_pd(PI), vMinusPi = _mm_set1_pd(-PI), vTurn = _mm_set1_pd(2.0 * PI);
+		vPhase = _mm_add_pd(vPhase, vIncrement);
+		vPhase = select_pd(_mm_cmpgt_pd(vPhase, vPi), _mm_sub_pd(vPhase, vTurn), vPhase);
+		return select_pd(_mm_cmplt_pd(vPhase, vMinusPi), _mm_add_pd(vPhase, vTurn), vPhase);
+	}
+
+	//Folds [-PI, PI] onto [-PI/2, PI/2], where sine and triangle are odd and monotonic
+	inline __m128d fold_quarter(__m128d x)
+	{
+		const __m128d vPi = _mm_set1_pd(PI), vMinusPi = _mm_set1_pd(-PI);
+		const __m128d vHalfPi = _mm_set1_pd(PI / 2.0), vMinusHalfPi = _mm_set1_pd(-PI / 2.0);
+		x = select_pd(_mm_cmpgt_pd(x, vHalfPi), _mm_sub_pd(vPi, x), x);
+		return select_pd(_mm_cmplt_pd(x, vMinusHalfPi), _mm_sub_pd(vMinusPi, x), x);
+	}
+
+	template<int WAVE>
+	inline __m128d wave(__m128d x)
+	{
+		switch (WAVE)
+		{
+		case OSC_SINE:
+		{
+			x = fold_quarter(x);
+			__m128d x2 = _mm_mul_pd(x, x);
+			__m128d p = _mm_add_pd(_mm_set1_pd(-1.0 / 39916800.0), _mm_mul_pd(x2, _mm_set1_pd(1.0 / 6227020800.0)));
+			p = _mm_add_pd(_mm_set1_pd(1.0 / 362880.0), _mm_mul_pd(x2, p));
+			p = _mm_add_pd(_mm_set1_pd(-1.0 / 5040.0), _mm_mul_pd(x2, p));
+			p = _mm_add_pd(_mm_set1_pd(1.0 / 120.0), _mm_mul_pd(x2, p));
+			p = _mm_add_pd(_mm_set1_pd(-1.0 / 6.0), _mm_mul_pd(x2, p));
+			p = _mm_add_pd(_mm_set1_pd(1.0), _mm_mul_pd(x2, p));
+			return _mm_mul_pd(x, p);
+		}
+
+		case OSC_SQUARE:
+		{
+			__m128d vHigh = _mm_and_pd(_mm_cmpgt_pd(x, _mm_setzero_pd()), _mm_cmplt_pd(x, _mm_set1_pd(PI)));
+			return select_pd(vHigh, _mm_set1_pd(1.0), _mm_set1_pd(-1.0));
+		}
+
+		case OSC_TRIANGLE:
+			return _mm_mul_pd(fold_quarter(x), _mm_set1_pd(2.0 / PI));
+
+		default:
+			return _mm_setzero_pd();
+		}
+	}
+
+	//Eight lanes of one partial from nStart to nEnd, see voice_bank::render_partial().
+	//Returns false for waveforms without an SSE2 version, which stay scalar.
+	template<int WAVE>
+	inline bool render_lanes(double *pPhase, const double *pIncrement, const double *pGain, const double *pLevel, const double *pSlope, int nStart, int nEnd, double *pOutput)
+	{
+		if (WAVE != OSC_SINE && WAVE != OSC_SQUARE && WAVE != OSC_TRIANGLE)
+			return false;
+
+		__m128d vPhase[4], vIncrement[4], vGain[4], vLevel[4], vSlope[4];
+		for (int r = 0; r < 4; r++)
+		{
+			vPhase[r] = _mm_loadu_pd(pPhase + 2 * r);
+			vIncrement[r] = _mm_loadu_pd(pIncrement + 2 * r);
+			vGain[r] = _mm_loadu_pd(pGain + 2 * r);
+			vLevel[r] = _mm_loadu_pd(pLevel + 2 * r);
+			vSlope[r] = _mm_loadu_pd(pSlope + 2 * r);
+		}
+
+		for (int m = nStart; m < nEnd; m++)
+		{
+			__m128d vK = _mm_set1_pd((double)(m - nStart));
+			__m128d y[4];
+			for (int r = 0; r < 4; r++)
+			{
+				y[r] = _mm_mul_pd(_mm_mul_pd(vGain[r], _mm_add_pd(vLevel[r], _mm_mul_pd(vK, vSlope[r]))), wave<WAVE>(vPhase[r]));
+				vPhase[r] = advance_phase(vPhase[r], vIncrement[r]);
+			}
+
+			//((y0 + y1) + (y2 + y3)) + ((y4 + y5) + (y6 + y7)), as the scalar kernel sums
+			__m128d vLow = _mm_add_pd(_mm_unpacklo_pd(y[0], y[1]), _mm_unpackhi_pd(y[0], y[1]));
+			__m128d vHigh = _mm_add_pd(_mm_unpacklo_pd(y[2], y[3]), _mm_unpackhi_pd(y[2], y[3]));
+			__m128d vSum = _mm_add_pd(_mm_unpacklo_pd(vLow, vHigh), _mm_unpackhi_pd(vLow, vHigh));
+			pOutput[m] += _mm_cvtsd_f64(_mm_add_sd(vSum, _mm_unpackhi_pd(vSum, vSum)));
+		}
+
+		for (int r = 0; r < 4; r++)
+			_mm_storeu_pd(pPhase + 2 * r, vPhase[r]);
+		return true;
+	}
+
+	//Four float lanes per register would need their own kernel, floats stay scalar
+	template<int WAVE>
+	inline bool render_lanes(float *, const float *, const float *, const float *, const float *, int, int, float *)
+	{
+		return false;
+	}
+
+	//Pins nBytes at pAddress in physical memory, returning false if refused.
+	//Supplied by the platform layer (e.g. LockMemory() in RealTime.h), since
+	//nothing here depends on the OS.
+	typedef bool(*memory_lock)(void *pAddress, size_t nBytes);
+
+	//Locks a vector's whole allocation, so it must not grow afterwards
+	template<class T>
+	inline bool lock_vector(const vector<T> &v, memory_lock pfnLock, size_t &nBytes)
+	{
+		if (v.capacity() == 0)
+			return true;
+
+		nBytes += v.capacity() * sizeof(T);
+		return pfnLock((void*)v.data(), v.capacity() * sizeof(T));
+	}
+
+	struct instrument_base;
+
+	//Render state for all voices of one instrument, as structure of arrays.
+	//Lane p * nStride + v holds partial p of voice v, so every partial is a
+	//contiguous run of voices and the kernel steps through them LANES at a
+	//time, one instruction covering the same oscillator of several voices.
+	struct voice_bank
+	{
+		static const int LANES = 8;
+
+		int nVoices;
+		int nStride;					//nVoices rounded up to LANES
+		vector<synth::note*> vecVoices;
+
+		//Per lane
+		vector<FTYPE> dPhase;
+		vector<FTYPE> dIncrement;
+		vector<FTYPE> dGain;
+		vector<FTYPE> dHertz;
+		vector<FTYPE> dLFO;
+		vector<unsigned int> nNoise;
+
+		//Per voice
+		vector<FTYPE> dOn;
+		vector<FTYPE> dOff;
+		vector<FTYPE> dEnvLevel;
+		vector<FTYPE> dEnvSlope;
+		vector<int> nFadeStart;			//Per voice in vecVoices, block sample where a cached voice starts fading to live
+		vector<synth::note*> vecCachedOnly;
+
+		vector<int> vecCuts;
+
+		static const int CROSSFADE = 64;		//Samples to fade from cached to live playback
+
+		//Phases are set from the note's age every PHASE_GRID samples of the absolute
+		//timeline and stepped in between, so output does not depend on where blocks
+		//are split (a block split at a key press renders the same as one that is not)
+		static const int PHASE_GRID = 64;
+		unsigned long long nFirstSample;		//Absolute sample of the gathered block's first sample
+		FTYPE dSampleStep;
+
+		voice_bank()
+		{
+			nVoices = 0;
+			nStride = 0;
+			nFirstSample = 0;
+			dSampleStep = 0.0;
+		}
+
+		//Phase of a lane at absolute sample nSample, from the voice's age alone
+		FTYPE anchor_phase(int nLane, int v, unsigned long long nSample)
+		{
+			FTYPE dAge = dOn[v] - (FTYPE)((double)nSample * dSampleStep);
+			return wrap_phase(w(dAge) * dHertz[nLane] + dLFO[nLane] * dAge);
+		}
+
+		void anchor_phases(int nPartials, unsigned long long nSample)
+		{
+			for (int p = 0; p < nPartials; p++)
+				for (int v = 0; v < nVoices; v++)
+					dPhase[p * nStride + v] = anchor_phase(p * nStride + v, v, nSample);
+		}
+
+		//Sizes every array for nMaxVoices voices and blocks of nMaxSamples, so
+		//gather() and render() never allocate for that many
+		void reserve(int nPartials, int nMaxVoices, int nMaxSamples)
+		{
+			int nMaxStride = (nMaxVoices + LANES - 1) / LANES * LANES;
+			size_t nLanes = (size_t)nPartials * nMaxStride;
+			if (dPhase.size() < nLanes)
+			{
+				dPhase.resize(nLanes);
+				dIncrement.resize(nLanes);
+				dGain.resize(nLanes);
+				dHertz.resize(nLanes);
+				dLFO.resize(nLanes);
+				nNoise.resize(nLanes);
+			}
+			if (dOn.size() < (size_t)nMaxStride)
+			{
+				dOn.resize(nMaxStride);
+				dOff.resize(nMaxStride);
+				dEnvLevel.resize(nMaxStride);
+				dEnvSlope.resize(nMaxStride);
+			}
+			vecVoices.reserve(nMaxVoices);
+			vecCachedOnly.reserve(nMaxVoices);
+			nFadeStart.reserve(nMaxVoices);
+
+			//Envelope breakpoints and crossfade samples per voice, plus the phase grid
+			vecCuts.reserve((size_t)nMaxVoices * (8 + CROSSFADE + 1) + nMaxSamples / PHASE_GRID + 2);
+		}
+
+		bool lock(memory_lock pfnLock, size_t &nBytes)
+		{
+			bool bLocked = true;
+			bLocked &= lock_vector(vecVoices, pfnLock, nBytes);
+			bLocked &= lock_vector(dPhase, pfnLock, nBytes);
+			bLocked &= lock_vector(dIncrement, pfnLock, nBytes);
+			bLocked &= lock_vector(dGain, pfnLock, nBytes);
+			bLocked &= lock_vector(dHertz, pfnLock, nBytes);
+			bLocked &= lock_vector(dLFO, pfnLock, nBytes);
+			bLocked &= lock_vector(nNoise, pfnLock, nBytes);
+			bLocked &= lock_vector(dOn, pfnLock, nBytes);
+			bLocked &= lock_vector(dOff, pfnLock, nBytes);
+			bLocked &= lock_vector(dEnvLevel, pfnLock, nBytes);
+			bLocked &= lock_vector(dEnvSlope, pfnLock, nBytes);
+			bLocked &= lock_vector(nFadeStart, pfnLock, nBytes);
+			bLocked &= lock_vector(vecCachedOnly, pfnLock, nBytes);
+			bLocked &= lock_vector(vecCuts, pfnLock, nBytes);
+			return bLocked;
+		}
+
+		void gather(instrument_base &instr, vector<synth::note> &vecNotes, int nChannel, FTYPE dTimeStep, unsigned long long nSample, int nSamples);
+		int hand_over(instrument_base &instr, synth::note &n, FTYPE dTimeStep, unsigned long long nSample);
+		void render(instrument_base &instr, FTYPE dTime, FTYPE dTimeStep, FTYPE *pOutput, int nSamples);
+		void mix_cached(instrument_base &instr, FTYPE dTime, FTYPE dTimeStep, unsigned long long nSample, FTYPE *pOutput, int nSamples);
+
+		FTYPE fade_in(int m, int v)		//Weight of live output during a crossfade
+		{
+			return (FTYPE)(m - nFadeStart[v] + 1) / (FTYPE)(CROSSFADE + 1);
+		}
+
+		//Sine, square and triangle run through the SSE2 kernel (render_lanes), the
+		//rest one lane at a time below
+		template<int WAVE>
+		void render_partial(int nPartial, int nStart, int nEnd, FTYPE *pOutput)
+		{
+			static_assert(LANES == 8, "render_lanes() and the sum below take eight lanes");
+			for (int c = 0; c < nStride; c += LANES)
+			{
+				int nLane = nPartial * nStride + c;
+				if (render_lanes<WAVE>(&dPhase[nLane], &dIncrement[nLane], &dGain[nLane], &dEnvLevel[c], &dEnvSlope[c], nStart, nEnd, pOutput))
+					continue;
+
+				FTYPE phase[LANES], inc[LANES], gain[LANES], level[LANES], slope[LANES];
+				unsigned int noise[LANES];
+				for (int j = 0; j < LANES; j++)
+				{
+					phase[j] = dPhase[nLane + j];
+					inc[j] = dIncrement[nLane + j];
+					gain[j] = dGain[nLane + j];
+					noise[j] = nNoise[nLane + j];
+					level[j] = dEnvLevel[c + j];
+					slope[j] = dEnvSlope[c + j];
+				}
+
+				for (int m = nStart; m < nEnd; m++)
+				{
+					FTYPE k = (FTYPE)(m - nStart);
+					FTYPE y[LANES];
+					for (int j = 0; j < LANES; j++)
+					{
+						y[j] = gain[j] * (level[j] + k * slope[j]) * wave<WAVE>(phase[j], noise[j]);
+						phase[j] = advance_phase(phase[j], inc[j]);
+					}
+					pOutput[m] += ((y[0] + y[1]) + (y[2] + y[3])) + ((y[4] + y[5]) + (y[6] + y[7]));
+				}
+
+				for (int j = 0; j < LANES; j++)
+				{
+					dPhase[nLane + j] = phase[j];
+					nNoise[nLane + j] = noise[j];
+				}
+			}
+		}
+
+		//Waveforms that are not a function of phase alone go through osc() per lane
+		void render_partial_scalar(const partial &p, int nPartial, FTYPE dTime, FTYPE dTimeStep, int nStart, int nEnd, FTYPE *pOutput)
+		{
+			for (int v = 0; v < nVoices; v++)
+			{
+				int nLane = nPartial * nStride + v;
+				for (int m = nStart; m < nEnd; m++)
+				{
+					FTYPE t = dTime + m * dTimeStep;
+					FTYPE dLevel = dEnvLevel[v] + (m - nStart) * dEnvSlope[v];
+					pOutput[m] += dGain[nLane] * dLevel * osc(dOn[v] - t, dHertz[nLane], p.nWave, p.dLFOHertz, p.dLFOAmplitude);
+				}
+			}
+		}
+	};
+
+	struct instrument_base
+	{
+		FTYPE dVolume;
+		synth::envelope_adsr env;
+		vector<synth::partial> vecPartials;
+
+		//Optional oversampled bus, voices are summed at nFactor times the output rate
+		//and decimated once per instrument
+		synth::oversampler os;
+		vector<FTYPE> vecBus;
+
+		//Optional lower internal rate for instruments without much high frequency
+		//content, converted to the output rate once per instrument. 0 renders at the
+		//output rate. Set through engine::set_internal_rate().
+		unsigned int nInternalRate;
+		synth::resampler rs;
+		vector<FTYPE> vecInternal;
+
+		synth::voice_bank bank;
+
+		//Output depends only on note and time since note on, so attack/decay can be
+		//pre-rendered (see note_cache). Bump nPatchVersion after editing the patch.
+		bool bCacheable;
+		unsigned int nPatchVersion;
+
+		instrument_base()
+		{
+			dVolume = 1.0;
+			bCacheable = false;
+			nPatchVersion = 0;
+			nInternalRate = 0;
+			set_oversampling(1);
+		}
+
+		void patch_changed()
+		{
+			nPatchVersion++;
+		}
+
+		void set_oversampling(int nFactor)
+		{
+			os.set_factor(nFactor);
+		}
+
+		virtual void reset()		//Clears any state carried between blocks
+		{
+			os.reset();
+			rs.reset();
+		}
+
+		//Buses and voice arrays for up to nMaxVoices voices in blocks of
+		//nBlockSamples at the output rate, call once the rates are set
+		void reserve(int nMaxVoices, unsigned int nBlockSamples)
+		{
+			unsigned int nInput = nBlockSamples;
+			if (nInternalRate != 0)
+				nInput = (unsigned int)((unsigned long long)nBlockSamples * rs.nDown / rs.nUp + 2);
+
+			vecBus.reserve(nInput * os.nFactor);
+			vecInternal.reserve(nInput);
+			bank.reserve((int)vecPartials.size(), nMaxVoices, nInput * os.nFactor);
+		}
+
+		//Everything render() reads or writes for this instrument
+		bool lock(memory_lock pfnLock, size_t &nBytes)
+		{
+			bool bLocked = true;
+			bLocked &= lock_vector(vecPartials, pfnLock, nBytes);
+			bLocked &= lock_vector(os.vecStages, pfnLock, nBytes);
+			for (auto &stage : os.vecStages)
+			{
+				bLocked &= lock_vector(stage.vecCoeff, pfnLock, nBytes);
+				bLocked &= lock_vector(stage.vecEven, pfnLock, nBytes);
+				bLocked &= lock_vector(stage.vecOdd, pfnLock, nBytes);
+			}
+			bLocked &= lock_vector(*rs.pCoeff, pfnLock, nBytes);		//Shared with other resamplers at the same rates
+			bLocked &= lock_vector(rs.vecHistory, pfnLock, nBytes);
+			bLocked &= lock_vector(vecBus, pfnLock, nBytes);
+			bLocked &= lock_vector(vecInternal, pfnLock, nBytes);
+			bLocked &= bank.lock(pfnLock, nBytes);
+			return bLocked;
+		}
+	};
+
+	//Collects the instrument's voices into the lanes and sets every oscillator's
+	//phase at absolute sample nSample, anchored on the PHASE_GRID point at or
+	//before it, so block boundaries never accumulate phase error
+	inline void voice_bank::gather(instrument_base &instr, vector<synth::note> &vecNotes, int nChannel, FTYPE dTimeStep, unsigned long long nSample, int nSamples)
+	{
+		nFirstSample = nSample;
+		dSampleStep = dTimeStep;
+
+		//Voices playing only from the cache this block go last and get no lanes
+		vecVoices.clear();
+		vecCachedOnly.clear();
+		nFadeStart.clear();
+		for (auto &n : vecNotes)
+		{
+			if (n.channel != nChannel)
+				continue;
+
+			int nFade = hand_over(instr, n, dTimeStep, nSample);
+			if (nFade != INT_MIN && nFade >= nSamples)
+				vecCachedOnly.push_back(&n);
+			else
+			{
+				vecVoices.push_back(&n);
+				nFadeStart.push_back(nFade);
+			}
+		}
+
+		nVoices = (int)vecVoices.size();
+		nStride = (nVoices + LANES - 1) / LANES * LANES;
+		for (auto n : vecCachedOnly)
+		{
+			vecVoices.push_back(n);
+			nFadeStart.push_back(INT_MAX / 2);
+		}
+
+		size_t nLanes = instr.vecPartials.size() * nStride;
+		if (dPhase.size() < nLanes)
+		{
+			dPhase.resize(nLanes);
+			dIncrement.resize(nLanes);
+			dGain.resize(nLanes);
+			dHertz.resize(nLanes);
+			dLFO.resize(nLanes);
+			nNoise.resize(nLanes);
+		}
+		if (dOn.size() < (size_t)nStride)
+		{
+			dOn.resize(nStride);
+			dOff.resize(nStride);
+			dEnvLevel.resize(nStride);
+			dEnvSlope.resize(nStride);
+		}
+
+		for (int v = 0; v < nStride; v++)
+		{
+			dOn[v] = v < nVoices ? vecVoices[v]->on : 0.0;
+			dOff[v] = v < nVoices ? vecVoices[v]->off : 0.0;
+			dEnvLevel[v] = 0.0;
+			dEnvSlope[v] = 0.0;
+		}
+
+		for (size_t p = 0; p < instr.vecPartials.size(); p++)
+		{
+			const partial &part = instr.vecPartials[p];
+			for (int v = 0; v < nStride; v++)
+			{
+				int nLane = (int)p * nStride + v;
+				if (v >= nVoices)
+				{
+					dPhase[nLane] = 0.0;
+					dIncrement[nLane] = 0.0;
+					dGain[nLane] = 0.0;
+					dHertz[nLane] = 0.0;
+					dLFO[nLane] = 0.0;
+					nNoise[nLane] = 1;
+					continue;
+				}
+
+				synth::note &n = *vecVoices[v];
+				FTYPE dHz = synth::scale(n.id + part.nNoteOffset);
+				dHertz[nLane] = dHz;
+				dLFO[nLane] = part.dLFOAmplitude * sin(w(part.dLFOHertz) * dHz);
+
+				//Partials above the render rate step more than a turn per sample,
+				//reduced so the kernel's single wrap keeps the phase in range
+				dIncrement[nLane] = wrap_phase(-(w(dHz) + dLFO[nLane]) * dTimeStep);
+
+				//From the grid point at or before the block, stepped as the kernel would
+				unsigned long long nAnchor = nSample - nSample % PHASE_GRID;
+				dPhase[nLane] = anchor_phase(nLane, v, nAnchor);
+				for (unsigned long long k = nAnchor; k < nSample; k++)
+					dPhase[nLane] = advance_phase(dPhase[nLane], dIncrement[nLane]);
+
+				dGain[nLane] = part.dGain * instr.dVolume;
+				nNoise[nLane] = noise_seed((unsigned int)(n.id * 16 + nChannel), (unsigned int)p, nSample);
+			}
+		}
+	}
+
+	//Splits the block wherever any voice's envelope changes segment, then runs
+	//each partial across all voices for every span
+	inline void voice_bank::render(instrument_base &instr, FTYPE dTime, FTYPE dTimeStep, FTYPE *pOutput, int nSamples)
+	{
+		if (nVoices == 0)
+			return;
+
+		vecCuts.clear();
+		vecCuts.push_back(0);
+		vecCuts.push_back(nSamples);
+		for (int v = 0; v < nVoices; v++)
+		{
+			FTYPE dTimes[8];
+			int nTimes = instr.env.breakpoints(dOn[v], dOff[v], dTimes);
+			for (int b = 0; b < nTimes; b++)
+			{
+				FTYPE dIndex = ceil((dTimes[b] - dTime) / dTimeStep);
+				if (dIndex > 0.0 && dIndex < (FTYPE)nSamples)
+					vecCuts.push_back((int)dIndex);
+			}
+
+			//Muted while cached, then one sample spans while the crossfade ramps
+			if (nFadeStart[v] != INT_MIN)
+			{
+				int nFrom = (std::max)(nFadeStart[v], 0);
+				int nTo = (std::min)(nFadeStart[v] + CROSSFADE, nSamples);
+				for (int m = nFrom; m <= nTo && m < nSamples; m++)
+					vecCuts.push_back(m);
+			}
+		}
+		for (int m = (int)((PHASE_GRID - nFirstSample % PHASE_GRID) % PHASE_GRID); m < nSamples; m += PHASE_GRID)
+			vecCuts.push_back(m);
+		sort(vecCuts.begin(), vecCuts.end());
+		vecCuts.erase(unique(vecCuts.begin(), vecCuts.end()), vecCuts.end());
+
+		for (size_t c = 0; c + 1 < vecCuts.size(); c++)
+		{
+			int nStart = vecCuts[c];
+			int nEnd = vecCuts[c + 1];
+
+			if ((nFirstSample + nStart) % PHASE_GRID == 0)
+				anchor_phases((int)instr.vecPartials.size(), nFirstSample + nStart);
+
+			for (int v = 0; v < nVoices; v++)
+			{
+				FTYPE dFirst = instr.env.amplitude(dTime + nStart * dTimeStep, dOn[v], dOff[v]);
+				FTYPE dLast = nEnd - 1 > nStart ? instr.env.amplitude(dTime + (nEnd - 1) * dTimeStep, dOn[v], dOff[v]) : dFirst;
+				dEnvLevel[v] = dFirst;
+				dEnvSlope[v] = nEnd - 1 > nStart ? (dLast - dFirst) / (nEnd - 1 - nStart) : 0.0;
+
+				if (nFadeStart[v] != INT_MIN && nStart < nFadeStart[v] + CROSSFADE)
+				{
+					dEnvLevel[v] = nStart < nFadeStart[v] ? 0.0 : dFirst * fade_in(nStart, v);
+					dEnvSlope[v] = 0.0;
+				}
+			}
+
+			for (size_t p = 0; p < instr.vecPartials.size(); p++)
+			{
+				switch (instr.vecPartials[p].nWave)
+				{
+				case OSC_SINE: render_partial<OSC_SINE>((int)p, nStart, nEnd, pOutput); break;
+				case OSC_SQUARE: render_partial<OSC_SQUARE>((int)p, nStart, nEnd, pOutput); break;
+				case OSC_TRIANGLE: render_partial<OSC_TRIANGLE>((int)p, nStart, nEnd, pOutput); break;
+				case OSC_SAW_AN: render_partial<OSC_SAW_AN>((int)p, nStart, nEnd, pOutput); break;
+				case OSC_NOISE: render_partial<OSC_NOISE>((int)p, nStart, nEnd, pOutput); break;
+				default: render_partial_scalar(instr.vecPartials[p], (int)p, dTime, dTimeStep, nStart, nEnd, pOutput); break;
+				}
+			}
+		}
+	}
+
+	//Cached voices hand over to live rendering on release, at the end of the
+	//cached segment, or when the patch has changed since it was rendered.
+	//Returns where the crossfade starts relative to nSample, INT_MIN if live.
+	inline int voice_bank::hand_over(instrument_base &instr, synth::note &n, FTYPE dTimeStep, unsigned long long nSample)
+	{
+		if (!n.cache)
+			return INT_MIN;
+
+		//Released notes finish the crossfade inside the attack/decay, past it the
+		//held envelope may be zero and the cache cannot be rescaled to the release
+		long long nHandOver = n.nCacheStart + (long long)n.cache->size() - CROSSFADE;
+		if (n.off > n.on)
+			nHandOver = (std::min)(nHandOver - CROSSFADE, (long long)ceil(n.off / dTimeStep));
+		if (n.nCachePatch != instr.nPatchVersion)
+			nHandOver = (std::min)(nHandOver, (long long)nSample);
+		if (n.nLiveFrom == LLONG_MAX && nHandOver < (long long)nSample)
+			nHandOver = (long long)nSample;
+		n.nLiveFrom = (std::min)(n.nLiveFrom, nHandOver);
+
+		long long nFade = n.nLiveFrom - (long long)nSample;
+		if (nFade + CROSSFADE <= 0)
+		{
+			n.cache.reset();		//The cache keeps its own reference, so this never frees
+			return INT_MIN;
+		}
+
+		return (int)(std::min)(nFade, (long long)INT_MAX / 2);
+	}
+
+	//Adds the cached part of every cached voice, fading it out as live takes over.
+	//The cache holds the note as if still held, so once released it is rescaled
+	//by the ratio of release to held envelope and matches live output exactly.
+	inline void voice_bank::mix_cached(instrument_base &instr, FTYPE dTime, FTYPE dTimeStep, unsigned long long nSample, FTYPE *pOutput, int nSamples)
+	{
+		for (int v = 0; v < (int)vecVoices.size(); v++)
+		{
+			synth::note &n = *vecVoices[v];
+			if (nFadeStart[v] == INT_MIN || !n.cache)
+				continue;
+
+			const vector<FTYPE> &vecCache = *n.cache;
+			long long nOffset = (long long)nSample - n.nCacheStart;
+			int nEnd = (int)(std::min)((long long)nSamples, (long long)nFadeStart[v] + CROSSFADE);
+
+			for (int m = (std::max)(0, (int)-nOffset); m < nEnd; m++)
+			{
+				long long i = nOffset + m;
+				if (i >= (long long)vecCache.size())
+					break;
+
+				FTYPE dWeight = m < nFadeStart[v] ? 1.0 : 1.0 - fade_in(m, v);
+				FTYPE t = dTime + m * dTimeStep;
+				if (n.off > n.on && t >= n.off)
+				{
+					FTYPE dHeld = instr.env.amplitude(t, n.on, n.on - 1.0);
+					dWeight *= dHeld > 0.0 ? instr.env.amplitude(t, n.on, n.off) / dHeld : 0.0;
+				}
+
+				pOutput[m] += vecCache[(size_t)i] * dWeight;
+			}
+		}
+	}
+
+	//Pre-rendered attack/decay segments of deterministic instruments, keyed by
+	//instrument, note, patch version and bus rate, kept within a memory budget
+	//by evicting the least recently used entry that no voice is playing
+	struct note_cache
+	{
+		typedef tuple<int, int, unsigned int, unsigned int> cache_key;
+		typedef shared_ptr<const vector<FTYPE>> cache_entry;
+
+		map<cache_key, pair<cache_entry, list<cache_key>::iterator>> mapEntries;
+		list<cache_key> listRecent;			//Most recently used first
+		size_t nBudgetBytes;
+		size_t nUsedBytes;
+		unsigned long long nHits;
+		unsigned long long nMisses;
+		mutex muxCache;
+		synth::voice_bank bank;
+
+		//Segments are locked as they are rendered and unlocked when the last
+		//voice playing them lets go, if set (see engine::set_memory_lock)
+		memory_lock pfnLock;
+		memory_lock pfnUnlock;
+		unsigned long long nLockFailures;
+
+		struct segment_deleter
+		{
+			memory_lock pfnUnlock;		//Set once the segment is locked
+
+			segment_deleter()
+			{
+				pfnUnlock = nullptr;
+			}
+
+			void operator()(vector<FTYPE> *pSegment) const
+			{
+				if (pfnUnlock != nullptr)
+					pfnUnlock(&(*pSegment)[0], pSegment->size() * sizeof(FTYPE));
+				delete pSegment;
+			}
+		};
+
+		note_cache()
+		{
+			nBudgetBytes = 0;
+			nUsedBytes = 0;
+			nHits = 0;
+			nMisses = 0;
+			pfnLock = nullptr;
+			pfnUnlock = nullptr;
+			nLockFailures = 0;
+		}
+
+		void clear()
+		{
+			unique_lock<mutex> lm(muxCache);
+			mapEntries.clear();
+			listRecent.clear();
+			nUsedBytes = 0;
+		}
+
+		//Renders on a miss, so call this from the thread pressing keys, never the audio thread.
+		//Returns nothing if the segment does not fit in the budget.
+		cache_entry fetch(instrument_base &instr, int nChannel, int nNoteID, unsigned int nBusRate)
+		{
+			unique_lock<mutex> lm(muxCache);
+			cache_key key = make_tuple(nChannel, nNoteID, instr.nPatchVersion, nBusRate);
+
+			auto found = mapEntries.find(key);
+			if (found != mapEntries.end())
+			{
+				listRecent.splice(listRecent.begin(), listRecent, found->second.second);
+				nHits++;
+				return found->second.first;
+			}
+			nMisses++;
+
+			size_t nSamples = (size_t)ceil((instr.env.dAttackTime + instr.env.dDecayTime) * nBusRate) + voice_bank::CROSSFADE;
+			size_t nBytes = nSamples * sizeof(FTYPE);
+			while (nUsedBytes + nBytes > nBudgetBytes && evict())
+				;
+			if (nUsedBytes + nBytes > nBudgetBytes)
+				return cache_entry();
+
+			//Held note starting at time zero, rendered by the same kernel as live voices
+			vector<synth::note> vecNote(1);
+			vecNote[0].id = nNoteID;
+			vecNote[0].channel = nChannel;
+			vecNote[0].on = 0.0;
+			vecNote[0].off = -1.0;
+			vecNote[0].active = true;
+
+			shared_ptr<vector<FTYPE>> vecSegment(new vector<FTYPE>(nSamples, 0.0), segment_deleter());
+			FTYPE dStep = (FTYPE)(1.0 / nBusRate);
+			bank.gather(instr, vecNote, nChannel, dStep, 0, (int)nSamples);
+			bank.render(instr, 0.0, dStep, &(*vecSegment)[0], (int)nSamples);
+
+			//Voices read the segment on the audio thread, so it is pinned before any can
+			if (pfnLock != nullptr)
+			{
+				if (pfnLock(&(*vecSegment)[0], nBytes))
+					get_deleter<segment_deleter>(vecSegment)->pfnUnlock = pfnUnlock;
+				else
+					nLockFailures++;
+			}
+
+			listRecent.push_front(key);
+			mapEntries[key] = make_pair(cache_entry(vecSegment), listRecent.begin());
+			nUsedBytes += nBytes;
+			return vecSegment;
+		}
+
+		bool evict()
+		{
+			for (auto i = listRecent.rbegin(); i != listRecent.rend(); ++i)
+			{
+				auto found = mapEntries.find(*i);
+				if (found->second.first.use_count() > 1)
+					continue;		//Still playing
+
+				nUsedBytes -= found->second.first->size() * sizeof(FTYPE);
+				listRecent.erase(found->second.second);
+				mapEntries.erase(found);
+				return true;
+			}
+			return false;
+		}
+	};
+
+	struct bell : public instrument_base
+	{
+		bell()
+		{
+			env.dAttackTime = 0.001;
+			env.dDecayTime = 1.0;
+			//env.dStartAmplitude = 1.0;
+			env.dSustainAmplitude = 0.0;
+			env.dReleaseTime = 1.0;
+
+			dVolume = 1.0;
+			bCacheable = true;
+
+			vecPartials.push_back(synth::partial(synth::OSC_SINE, 0, 1.0, 5.0, 0.001));
+			vecPartials.push_back(synth::partial(synth::OSC_SINE, 12, 0.5));
+			vecPartials.push_back(synth::partial(synth::OSC_SINE, 24, 0.25));
+		}
+	};
+
+	struct harmonica : public instrument_base
+	{
+		harmonica()
+		{
+			env.dAttackTime = 0.05;
+			env.dDecayTime = 1.0;
+			env.dReleaseTime = 0.1;
+			env.dSustainAmplitude = 0.95;
+			//env.dStartAmplitude = 0.200;
+
+			dVolume = 1.0;
+
+			vecPartials.push_back(synth::partial(synth::OSC_SQUARE, 0, 1.0, 5.0, 0.001));
+			vecPartials.push_back(synth::partial(synth::OSC_SQUARE, 12, 0.5));
+			vecPartials.push_back(synth::partial(synth::OSC_SQUARE, 24, 0.25));
+			vecPartials.push_back(synth::partial(synth::OSC_NOISE, 0, 0.05));
+
+			set_oversampling(4);		//Stacked squares alias badly at upper keys
+		}
+	};
+
+	struct piano : public instrument_base
+	{
+		piano()
+		{
+			env.dAttackTime = 0.100;
+			env.dDecayTime = 0.01;
+			env.dReleaseTime = 0.01;
+			env.dSustainAmplitude = 0.8;
+			//env.dStartAmplitude = 0.200;
+
+			dVolume = 1.0;
+			bCacheable = true;
+
+			vecPartials.push_back(synth::partial(synth::OSC_SINE, 0, 1.0, 5.0, 0.001));
+			vecPartials.push_back(synth::partial(synth::OSC_SINE, 12, 0.5));
+		}
+	};
+
+	typedef bool(*lambda)(synth::note const& item);
+	template<class T>
+	void safe_remove(T &v, lambda f)
+	{
+		auto n = v.begin();
+		while (n != v.end())
+			if (!f(*n))
+				n = v.erase(n);
+			else
+				++n;
+	}
+
+	struct engine		//Voices and instruments for one output stream, no shared state between engines
+	{
+		vector<synth::note> vecNotes;
+		mutex muxNotes;
+		synth::bell instrBell;
+		synth::harmonica instrHarm;
+		synth::piano instrPiano;
+		synth::instrument_base *instruments[3];		//Indexed by channel
+		unsigned int nSampleRate;
+		FTYPE dMasterVolume;
+		synth::note_cache cache;
+
+		//Keys stamped later than what has been rendered, applied by render() on
+		//their sample so scripted input plays back sample accurately
+		struct scheduled_key
+		{
+			long long nSample;
+			int nNoteID;
+			int nChannel;
+			bool bPressed;
+			FTYPE dTime;
+			synth::note_cache::cache_entry entry;
+		};
+		vector<scheduled_key> vecScheduled;
+		unsigned long long nNextSample;		//First sample render() has not produced yet
+
+		engine(unsigned int nRate = 44100)
+		{
+			instruments[0] = &instrPiano;
+			instruments[1] = &instrHarm;
+			instruments[2] = &instrBell;
+			nSampleRate = nRate;
+			dMasterVolume = 0.05;
+			nNextSample = 0;
+		}
+
+		//Output rate of the stream, every time constant is in seconds so nothing else changes
+		void set_sample_rate(unsigned int nRate)
+		{
+			unsigned int nInternalRates[3];
+			for (int c = 0; c < 3; c++)
+				nInternalRates[c] = instruments[c]->nInternalRate;
+			set_rates(nRate, nInternalRates);
+		}
+
+		//Output rate and each channel's internal rate together, so every
+		//resampler is built once for the final pair of rates
+		void set_rates(unsigned int nRate, const unsigned int *pInternalRates)
+		{
+			nSampleRate = nRate;
+			for (int c = 0; c < 3; c++)
+				set_internal_rate(c, pInternalRates[c]);
+			set_cache_budget(cache.nBudgetBytes);
+			reset();
+		}
+
+		//Renders one channel's instrument at nRate and resamples it, 0 (or the output rate) turns it off
+		void set_internal_rate(int nChannel, unsigned int nRate)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			synth::instrument_base *instr = instruments[nChannel];
+			instr->nInternalRate = nRate == nSampleRate ? 0 : nRate;
+			if (instr->nInternalRate != 0)
+				instr->rs.init(instr->nInternalRate, nSampleRate);
+			instr->vecInternal.clear();
+		}
+
+		//Opt in to playing cacheable instruments from pre-rendered segments, 0 turns it off
+		void set_cache_budget(size_t nBytes)
+		{
+			cache.clear();
+			cache.nBudgetBytes = nBytes;
+		}
+
+		//Sizes everything render() uses for nMaxVoices voices and blocks of up to
+		//nBlockSamples, so the audio thread never allocates below that. Call once
+		//the rates are set, changing them reallocates.
+		void reserve(int nMaxVoices, unsigned int nBlockSamples)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			vecNotes.reserve(nMaxVoices);
+			vecScheduled.reserve(nMaxVoices * 2);
+			for (auto instr : instruments)
+				instr->reserve(nMaxVoices, nBlockSamples);
+		}
+
+		//Locks the engine and every buffer render() touches with pfnLock, adding
+		//their size to nBytes. Returns false if any lock was refused.
+		bool lock_buffers(memory_lock pfnLock, size_t &nBytes)
+		{
+			unique_lock<mutex> lm(muxNotes);
+			nBytes += sizeof(*this);
+			bool bLocked = pfnLock(this, sizeof(*this));
+			bLocked &= lock_vector(vecNotes, pfnLock, nBytes);
+			bLocked &= lock_vector(vecScheduled, pfnLock, nBytes);
+			for (auto instr : instruments)
+				bLocked &= instr->lock(pfnLock, nBytes);
+			return bLocked;
+		}
+
+		//Locks cached segments as they are rendered, see note_cache
+		void set_memory_lock(memory_lock pfnLock, memory_lock pfnUnlock)
+		{
+			unique_lock<mutex> lm(cache.muxCache);
+			cache.pfnLock = pfnLock;
+			cache.pfnUnlock = pfnUnlock;
+		}
+
+		void reset()
+		{
+			unique_lock<mutex> lm(muxNotes);
+			vecNotes.clear();
+			vecScheduled.clear();
+			nNextSample = 0;
+			for (auto instr : instruments)
+				instr->reset();
+		}
+
+		//Key state for one note, repeated calls with the same state do nothing. A
+		//dTime past the rendered output is held until render() reaches it.
+		void key(int nNoteID, int nChannel, bool bPressed, FTYPE dTime)
+		{
+			//Keys land on a sample so cached segments line up exactly, and a key held
+			//for later takes effect on the sample render() splits the block at
+			long long nOnSample = (long long)floor(dTime * nSampleRate + 0.5);
+			dTime = (FTYPE)((double)nOnSample / (double)nSampleRate);
+
+			//Fetched before locking, a miss renders the segment on this thread. Notes
+			//are only on the grid of instruments rendering at the output rate.
+			synth::instrument_base *instr = instruments[nChannel];
+			synth::note_cache::cache_entry entry;
+			if (bPressed && instr->bCacheable && instr->nInternalRate == 0 && cache.nBudgetBytes > 0)
+				entry = cache.fetch(*instr, nChannel, nNoteID, nSampleRate * instr->os.nFactor);
+
+			unique_lock<mutex> lm(muxNotes);
+
+			if (nOnSample > (long long)nNextSample)
+			{
+				scheduled_key k;
+				k.nSample = nOnSample;
+				k.nNoteID = nNoteID;
+				k.nChannel = nChannel;
+				k.bPressed = bPressed;
+				k.dTime = dTime;
+				k.entry = entry;
+
+				//Keys due on the same sample keep the order they were given in
+				auto pos = upper_bound(vecScheduled.begin(), vecScheduled.end(), k, [](scheduled_key const& a, scheduled_key const& b) { return a.nSample < b.nSample; });
+				vecScheduled.insert(pos, k);
+				return;
+			}
+
+			apply_key(nNoteID, nChannel, bPressed, dTime, nOnSample, entry);
+		}
+
+		size_t voices()
+		{
+			unique_lock<mutex> lm(muxNotes);
+			return vecNotes.size();
+		}
+
+		//Renders nSamples starting at sample nStartSample of the engine timeline,
+		//split wherever a scheduled key falls
+		void render(unsigned long long nStartSample, FTYPE *pOutput, unsigned int nSamples)
+		{
+			unique_lock<mutex> lm(muxNotes);
+
+			unsigned int n = 0;
+			while (n < nSamples)
+			{
+				unsigned long long nSample = nStartSample + n;
+				while (!vecScheduled.empty() && vecScheduled.front().nSample <= (long long)nSample)
+				{
+					const scheduled_key &k = vecScheduled.front();
+					apply_key(k.nNoteID, k.nChannel, k.bPressed, k.dTime, k.nSample, k.entry);
+					vecScheduled.erase(vecScheduled.begin());
+				}
+
+				unsigned int nEnd = nSamples;
+				if (!vecScheduled.empty() && vecScheduled.front().nSample < (long long)(nStartSample + nSamples))
+					nEnd = (unsigned int)(vecScheduled.front().nSample - (long long)nStartSample);
+
+				render_span(nSample, pOutput + n, nEnd - n);
+				n = nEnd;
+			}
+
+			nNextSample = nStartSample + nSamples;
+		}
+
+		//Applies a key now, muxNotes must be held
+		void apply_key(int nNoteID, int nChannel, bool bPressed, FTYPE dTime, long long nOnSample, const synth::note_cache::cache_entry &entry)
+		{
+			synth::instrument_base *instr = instruments[nChannel];
+
+			//Check if note already exists in currently playing notes, the same note
+			//on another channel is a separate voice
+			auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&nNoteID, &nChannel](synth::note const& item) { return item.id == nNoteID && item.channel == nChannel; });
+			if (noteFound == vecNotes.end())
+			{
+				if (bPressed)
+				{
+					//Held until released, off is kept before on so a note pressed at
+					//time zero is not mistaken for one released on the same instant
+					synth::note n;
+					n.id = nNoteID;
+					n.on = dTime;
+					n.off = dTime - 1.0;
+					n.channel = nChannel;
+					n.active = true;
+					n.cache = entry;
+					n.nCacheStart = nOnSample * instr->os.nFactor;
+					n.nCachePatch = instr->nPatchVersion;
+
+					vecNotes.emplace_back(n);		//Adding note to vector
+				}
+			}
+
+			else
+			{
+				if (bPressed)
+				{
+					if (noteFound->off > noteFound->on)
+					{
+						//Key has been pressed again during the release state
+						noteFound->on = dTime;
+						noteFound->off = dTime - 1.0;
+						noteFound->active = true;
+						noteFound->cache = entry;
+						noteFound->nCacheStart = nOnSample * instr->os.nFactor;
+						noteFound->nLiveFrom = LLONG_MAX;
+						noteFound->nCachePatch = instr->nPatchVersion;
+					}
+				}
+
+				else
+				{
+					if (noteFound->off < noteFound->on)
+					{
+						//Key has been released so switch off
+						noteFound->off = dTime;
+					}
+				}
+			}
+		}
+
+		//One span of render() with no key changes inside it, muxNotes must be held
+		void render_span(unsigned long long nStartSample, FTYPE *pOutput, unsigned int nSamples)
+		{
+			double dTimeStep = 1.0 / (double)nSampleRate;
+			FTYPE dTime = (FTYPE)((double)nStartSample * dTimeStep);
+
+			for (unsigned int n = 0; n < nSamples; n++)
+				pOutput[n] = 0.0;
+
+			for (int c = 0; c < 3; c++)
+			{
+				synth::instrument_base *instr = instruments[c];
+				bool bResample = instr->nInternalRate != 0;
+
+				//Resampled instruments run on their own timeline, as far as this block's output needs
+				unsigned long long nFirst = nStartSample;
+				unsigned int nCount = nSamples;
+				FTYPE dFirst = dTime;
+				double dRateStep = dTimeStep;
+				if (bResample)
+				{
+					if (instr->rs.nNextOutput != nStartSample)
+						instr->rs.seek(nStartSample);
+					nFirst = instr->rs.nNextInput;
+					nCount = instr->rs.input_needed(nSamples);
+					dRateStep = 1.0 / (double)instr->nInternalRate;
+					dFirst = (FTYPE)((double)nFirst * dRateStep);
+				}
+
+				int nFactor = instr->os.nFactor;
+				FTYPE dStep = (FTYPE)(dRateStep / nFactor);
+
+				instr->bank.gather(*instr, vecNotes, c, dStep, nFirst * nFactor, nCount * nFactor);
+
+				if (nFactor == 1 && !bResample)
+				{
+					instr->bank.render(*instr, dFirst, dStep, pOutput, nSamples);
+					instr->bank.mix_cached(*instr, dFirst, dStep, nStartSample, pOutput, nSamples);
+				}
+				else if (nCount > 0)
+				{
+					//Decimate oversampled buses, these run even when silent so filter tails decay
+					instr->vecBus.assign(nCount * nFactor, 0.0);
+					instr->bank.render(*instr, dFirst, dStep, &instr->vecBus[0], nCount * nFactor);
+					instr->bank.mix_cached(*instr, dFirst, dStep, nFirst * nFactor, &instr->vecBus[0], nCount * nFactor);
+
+					FTYPE *pDecimated = pOutput;
+					if (bResample)
+					{
+						instr->vecInternal.assign(nCount, 0.0);
+						pDecimated = &instr->vecInternal[0];
+					}
+
+					for (unsigned int n = 0; n < nCount; n++)
+						pDecimated[n] += instr->os.process(&instr->vecBus[n * nFactor]);
+				}
+
+				if (bResample)
+					instr->rs.process(instr->vecInternal.empty() ? nullptr : &instr->vecInternal[0], pOutput, nSamples);
+
+				//Released voices that have decayed to nothing are done
+				FTYPE dEnd = dFirst + ((FTYPE)nCount * nFactor - 1) * dStep;
+				for (auto n : instr->bank.vecVoices)
+					if (n->off > n->on && instr->env.amplitude(dEnd, n->on, n->off) <= 0.0)
+						n->active = false;
+			}
+
+			for (unsigned int n = 0; n < nSamples; n++)
+				pOutput[n] *= dMasterVolume;
+
+			safe_remove<vector<synth::note>>(vecNotes, [](synth::note const& item) { return item.active; });
+		}
+	};
+
+	//Output and internal rates are accepted within this range
+	const unsigned int MIN_SAMPLE_RATE = 8000;
+	const unsigned int MAX_SAMPLE_RATE = 192000;
+
+	//Rates chosen on the command line, applied to every engine a mode creates
+	struct engine_rates
+	{
+		unsigned int nSampleRate;
+		unsigned int nInternalRate[3];		//Indexed by channel, 0 renders at the output rate
+
+		engine_rates(unsigned int nRate = 44100)
+		{
+			nSampleRate = nRate;
+			for (int c = 0; c < 3; c++)
+				nInternalRate[c] = 0;
+		}
+
+		bool resampled(int nChannel) const
+		{
+			return nInternalRate[nChannel] != 0 && nInternalRate[nChannel] != nSampleRate;
+		}
+
+		void apply(engine &e) const
+		{
+			e.set_rates(nSampleRate, nInternalRate);
+		}
+	};
+}
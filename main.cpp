@@ -1,311 +1,249 @@
 #include <list>
 #include <iostream>
 #include <algorithm>
+#include <cstdlib>
+#include <cfloat>
 
 #define FTYPE double
 #include "olcNoiseMaker.h"
+#include "Synth.h"
+#include "Golden.h"
+#include "Batch.h"
+#include "Input.h"
 
-namespace synth
-{
-	FTYPE w(FTYPE dHerz)		//Converts frequency(Hz) to angular velocity
-	{
-		return dHerz * 2.0 * PI;
-	}
+unsigned int nSampleRate = 44100;
 
-	struct note			//A basic note
-	{
-		int id;			//Position in scale
-		FTYPE on;		//Time note was activated
-		FTYPE off;		//Time note was deactivated
-		bool active;
-		int channel;
+synth::engine synthEngine(nSampleRate);
 
-		note()
-		{
-			id = 0;
-			on = 0.0;
-			off = 0.0;
-			active = false;
-			channel = 0;
-		}
-	};
-
-	const int OSC_SINE = 0;
-	const int OSC_SQUARE = 1;
-	const int OSC_TRIANGLE = 2;
-	const int OSC_SAW_AN = 3;
-	const int OSC_SAW_OP = 4;
-	const int OSC_NOISE = 5;
+//synth::instrument_base *voice = nullptr;
 
-	FTYPE osc(FTYPE dHertz, FTYPE dTime, int Type = OSC_SINE, FTYPE dLFOHertz = 0.0, FTYPE dLFOAmplitude = 0.0)
-	{
-		FTYPE dFreq = w(dHertz) * dTime + dLFOAmplitude * dHertz * sin(w(dLFOHertz) * dTime);			//base frequency
+//Whole number from nMin to nMax, anything else is refused rather than defaulted
+bool ParseUnsigned(const char *sText, unsigned int nMin, unsigned int nMax, unsigned int &nValue)
+{
+	char *pEnd = nullptr;
+	unsigned long n = strtoul(sText, &pEnd, 10);
+	if (pEnd == sText || *pEnd != '\0' || sText[0] == '-' || n < nMin || n > nMax)
+		return false;
 
-		switch (Type)
-		{
-		case OSC_SINE:		//Sine wave
-			return sin(dFreq);
+	nValue = (unsigned int)n;
+	return true;
+}
 
-		case OSC_SQUARE:		//Sqare wave
-			return sin(dFreq) > 0.0 ? 1.0 : -1.0;
+//Finite number of at least dMin, anything else is refused rather than defaulted
+bool ParseDouble(const char *sText, double dMin, double &dValue)
+{
+	char *pEnd = nullptr;
+	double d = strtod(sText, &pEnd);
+	if (pEnd == sText || *pEnd != '\0' || !(d >= dMin) || d > DBL_MAX)
+		return false;
 
-		case OSC_TRIANGLE:		//Triangle wave
-			return asin(sin(dFreq)) * (2.0 / PI);
+	dValue = d;
+	return true;
+}
 
-		case OSC_SAW_AN:		//Saw wave (analogue / warm / slow)
-		{
-			FTYPE dOutput = 0.0;
+//CPU mask for the audio thread, hex with 0x or decimal, at least one CPU
+bool ParseAffinity(const char *sText, DWORD_PTR &nMask)
+{
+	char *pEnd = nullptr;
+	unsigned long long n = strtoull(sText, &pEnd, 0);
+	if (pEnd == sText || *pEnd != '\0' || sText[0] == '-' || n == 0 || n != (DWORD_PTR)n)
+		return false;
 
-			for (FTYPE n = 1.0; n < 10.0; n++)
-				dOutput += (sin(n * dFreq)) / n;
+	nMask = (DWORD_PTR)n;
+	return true;
+}
 
-			return dOutput * (2.0 / PI);
-		}
+void MakeNoise(unsigned long long nStartSample, FTYPE *pOutput, unsigned int nSamples)
+{
+	synthEngine.render(nStartSample, pOutput, nSamples);
+}
 
-		case OSC_SAW_OP:		//Saw wave (optimized / harsh / fast)
-			return (2.0 / PI) * (dHertz * PI * fmod(dTime, 1.0 / dHertz) - (PI / 2.0));
+int main(int argc, char *argv[])
+{
+	wcout << "Synthesizer" << endl;
 
-		case OSC_NOISE:		//Pseudo Random Noise
-			return 2.0 * ((FTYPE)rand() / (FTYPE)RAND_MAX) - 1.0;
+	//Rates for every mode, taken out of the arguments before the mode is picked. Render
+	//at the device's native rate with e.g. --rate 48000, and render one channel's
+	//instrument at a lower rate and resample it with --internal-rate <channel> <Hz>.
+	synth::engine_rates rates(nSampleRate);
+	for (int a = 1; a < argc;)
+	{
+		string sArg = argv[a];
+		int nTaken = 0;
+		if (sArg == "--rate")
+		{
+			if (a + 1 >= argc || !ParseUnsigned(argv[a + 1], synth::MIN_SAMPLE_RATE, synth::MAX_SAMPLE_RATE, rates.nSampleRate))
+			{
+				wcout << "--rate needs a rate from " << synth::MIN_SAMPLE_RATE << " to " << synth::MAX_SAMPLE_RATE << " Hz" << endl;
+				return 1;
+			}
+			nTaken = 2;
+		}
+		else if (sArg == "--internal-rate")
+		{
+			unsigned int nChannel = 0, nRate = 0;
+			if (a + 2 >= argc || !ParseUnsigned(argv[a + 1], 0, 2, nChannel) || !ParseUnsigned(argv[a + 2], synth::MIN_SAMPLE_RATE, synth::MAX_SAMPLE_RATE, nRate))
+			{
+				wcout << "--internal-rate needs a channel from 0 to 2 and a rate from " << synth::MIN_SAMPLE_RATE << " to " << synth::MAX_SAMPLE_RATE << " Hz" << endl;
+				return 1;
+			}
+			rates.nInternalRate[nChannel] = nRate;
+			nTaken = 3;
+		}
 
-		default:
-			return 0.0;
+		if (nTaken == 0)
+		{
+			a++;
+			continue;
 		}
-	}
 
-	const int SCALE_DEFAULT = 0;
+		for (int b = a; b + nTaken < argc; b++)
+			argv[b] = argv[b + nTaken];
+		argc -= nTaken;
+	}
+	nSampleRate = rates.nSampleRate;
+	rates.apply(synthEngine);
 
-	FTYPE scale(const int nNoteID, const int nScaleID = SCALE_DEFAULT)
+	//Headless regression check, no audio device needed
+	if (argc > 2 && (string(argv[1]) == "--golden-record" || string(argv[1]) == "--golden-check"))
 	{
-		switch (nScaleID)
+		synth::golden_tolerance tol;
+		for (int a = 3; a < argc; a += 2)
 		{
-		case SCALE_DEFAULT: default:
-			return 256 * pow(1.0594630943592952645618252949463, nNoteID);
+			string sOption = argv[a];
+			double *pValue = nullptr;
+			double dMin = 0.0;
+			if (sOption == "--max-abs") pValue = &tol.dMaxAbsError;
+			else if (sOption == "--snr") { pValue = &tol.dMinSNR; dMin = -DBL_MAX; }
+			else if (sOption == "--spectral") pValue = &tol.dMaxSpectral;
+
+			if (pValue == nullptr)
+			{
+				wcout << "Unknown option " << sOption.c_str() << ", golden tolerances are --max-abs, --snr and --spectral" << endl;
+				return 1;
+			}
+			if (a + 1 >= argc || !ParseDouble(argv[a + 1], dMin, *pValue))
+			{
+				wcout << sOption.c_str() << " needs a number" << (dMin == 0.0 ? " of at least 0" : "") << endl;
+				return 1;
+			}
 		}
+
+		return synth::run_golden(argv[2], string(argv[1]) == "--golden-record", tol, rates) == 0 ? 0 : 1;
 	}
 
-	struct envelope
+	//Scripted playback against offline rendering, both are sample exact so only rounding may differ
+	if (argc > 1 && string(argv[1]) == "--replay-check")
 	{
-		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff) = 0;
-	};
+		synth::golden_tolerance tol;
+		tol.dMaxAbsError = 1e-9;
+		tol.dMinSNR = 120.0;
+		tol.dMaxSpectral = 0.001;
+		return synth::run_replay_check(tol, rates) == 0 ? 0 : 1;
+	}
 
-	struct envelope_adsr : public envelope
+	//Cost and accuracy of the --internal-rate channels, or of piano and bell at
+	//the given rate (half the output rate by default) if none are set
+	if (argc > 1 && string(argv[1]) == "--rate-bench")
 	{
-		FTYPE dAttackTime;
-		FTYPE dDecayTime;
-		FTYPE dReleaseTime;
-		FTYPE dSustainAmplitude;
-		FTYPE dStartAmplitude;
-
-		envelope_adsr()
+		synth::engine_rates bench = rates;
+		if (argc > 2 || (!bench.resampled(0) && !bench.resampled(1) && !bench.resampled(2)))
 		{
-			dAttackTime = 0.001;
-			dDecayTime = 1.0;
-			dStartAmplitude = 1.0;
-			dSustainAmplitude = 0.0;
-			dReleaseTime = 1.0;
+			unsigned int nRate = nSampleRate / 2;
+			if (argc > 2 && !ParseUnsigned(argv[2], synth::MIN_SAMPLE_RATE, synth::MAX_SAMPLE_RATE, nRate))
+			{
+				wcout << "--rate-bench needs a rate from " << synth::MIN_SAMPLE_RATE << " to " << synth::MAX_SAMPLE_RATE << " Hz" << endl;
+				return 1;
+			}
+			bench.nInternalRate[0] = nRate;
+			bench.nInternalRate[2] = nRate;
 		}
 
-		virtual FTYPE amplitude(const FTYPE dTime, const FTYPE dTimeOn, const FTYPE dTimeOff)
-		{
-			FTYPE dAmplitude = 0.0;
-			FTYPE dReleaseAmplitude = 0.0;
+		synth::run_rate_benchmark(bench);
+		return 0;
+	}
 
-			if (dTimeOn > dTimeOff)			//Note is on
+	//Offline rendering of a job manifest on every core, no audio device needed
+	if (argc > 3 && string(argv[1]) == "--batch")
+	{
+		unsigned int nThreads = 0;
+		for (int a = 4; a < argc; a += 2)
+		{
+			if (string(argv[a]) != "--threads")
 			{
-				FTYPE dLifeTime = dTime - dTimeOn;
-
-				// ASD
-				//Attack
-				if (dLifeTime <= dAttackTime)
-					dAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
-
-				//Decay
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
-
-				//Sustain
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dAmplitude = dSustainAmplitude;
+				wcout << "Unknown option " << argv[a] << ", --batch takes --threads <count>" << endl;
+				return 1;
 			}
-
-			else		//Note is off
+			if (a + 1 >= argc || !ParseUnsigned(argv[a + 1], 1, 1024, nThreads))
 			{
-				FTYPE dLifeTime = dTimeOff - dTimeOn;
-
-				if (dLifeTime <= dAttackTime)
-					dReleaseAmplitude = (dLifeTime / dAttackTime) * dStartAmplitude;
-
-				if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-					dReleaseAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
-
-				if (dLifeTime > (dAttackTime + dDecayTime))
-					dReleaseAmplitude = dSustainAmplitude;
-
-				//Release
-				dAmplitude = ((dTime - dTimeOff) / dReleaseTime) * (0.0 - dReleaseAmplitude) + dReleaseAmplitude;
+				wcout << "--threads needs a count from 1 to 1024" << endl;
+				return 1;
 			}
-
-			if (dAmplitude <= 0.000)
-				dAmplitude = 0.0;
-
-
-			return dAmplitude;
 		}
-	};
 
-	FTYPE env(const FTYPE dTime, envelope &env, const FTYPE dTimeOn, const FTYPE dTimeOff)
-	{
-		return env.amplitude(dTime, dTimeOn, dTimeOff);
+		return synth::run_batch_manifest(argv[2], argv[3], nThreads, rates) == 0 ? 0 : 1;
 	}
 
-	struct instrument_base
+	//Level meter reading another instance's shared ring: Synthesizer.exe --shm-read Local\Synthesizer
+	if (argc > 2 && string(argv[1]) == "--shm-read")
 	{
-		FTYPE dVolume;
-		synth::envelope_adsr env;
-		virtual FTYPE sound(const FTYPE dTime, synth::note n, bool&bNoteFinished) = 0;
-	};
+		string sName = argv[2];
+		return RunSharedRingMeter<short>(wstring(sName.begin(), sName.end()));
+	}
 
-	struct bell : public instrument_base
+	//Optional session recording, output to other processes and a scripted session
+	//in place of the keyboard (the first job of a --batch manifest), and where the
+	//audio thread runs:
+	//Synthesizer.exe [session.wav] [--shm Local\Synthesizer] [--replay sounds.txt]
+	//	[--affinity 0x4] [--priority-class high]
+	//(--rate and --internal-rate apply here too)
+	string sRecordFile, sSharedRing, sReplay;
+	RealTimeConfig rtConfig;
+	for (int a = 1; a < argc; a++)
 	{
-		bell()
+		string sArg = argv[a];
+		bool bTakesValue = sArg == "--shm" || sArg == "--replay" || sArg == "--affinity" || sArg == "--priority-class";
+		if (bTakesValue && (a + 1 >= argc || string(argv[a + 1]).compare(0, 2, "--") == 0))
 		{
-			env.dAttackTime = 0.001;
-			env.dDecayTime = 1.0;
-			//env.dStartAmplitude = 1.0;
-			env.dSustainAmplitude = 0.0;
-			env.dReleaseTime = 1.0;
-
-			dVolume = 1.0;
+			wcout << "Missing value for " << sArg.c_str() << endl;
+			return 1;
 		}
 
-		FTYPE sound(const FTYPE dTime, synth::note n, bool&bNoteFinished)
+		if (sArg == "--shm")
+			sSharedRing = argv[++a];
+		else if (sArg == "--replay")
+			sReplay = argv[++a];
+		else if (sArg == "--affinity")
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-
-			if (dAmplitude <= 0.0)
-				bNoteFinished = true;
-
-			FTYPE dSound =
-				+1.0 * synth::osc(n.on - dTime, synth::scale(n.id), synth::OSC_SINE, 5.0, 0.001)
-				+ 0.5 * synth::osc(n.on - dTime, synth::scale(n.id + 12))
-				+ 0.25 * synth::osc(n.on - dTime, synth::scale(n.id + 24));
-
-			return dAmplitude * dSound * dVolume;
+			if (!ParseAffinity(argv[++a], rtConfig.nAffinityMask))
+			{
+				wcout << "--affinity needs a non-zero CPU mask, e.g. 0x4 for CPU 2" << endl;
+				return 1;
+			}
 		}
-	};
-
-	struct harmonica : public instrument_base
-	{
-		harmonica()
+		else if (sArg == "--priority-class")
 		{
-			env.dAttackTime = 0.05;
-			env.dDecayTime = 1.0;
-			env.dReleaseTime = 0.1;
-			env.dSustainAmplitude = 0.95;
-			//env.dStartAmplitude = 0.200;
-
-			dVolume = 1.0;
-		}
-
-		FTYPE sound(const FTYPE dTime, synth::note n, bool&bNoteFinished)
-		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-
-			if (dAmplitude <= 0.0)
-				bNoteFinished = true;
-
-			FTYPE dSound =
-				+1.0 * synth::osc(n.on - dTime, synth::scale(n.id), synth::OSC_SQUARE, 5.0, 0.001)
-				+ 0.5 * synth::osc(n.on - dTime, synth::scale(n.id + 12), synth::OSC_SQUARE)
-				+ 0.25 * synth::osc(n.on - dTime, synth::scale(n.id + 24), synth::OSC_SQUARE)
-				+ 0.05 * synth::osc(n.on - dTime, dTime, synth::OSC_NOISE);
-
-			return dAmplitude * dSound * dVolume;
+			rtConfig.nPriorityClass = ParsePriorityClass(argv[++a]);
+			if (rtConfig.nPriorityClass == 0)
+			{
+				wcout << "--priority-class needs one of idle, below-normal, normal, above-normal, high, realtime" << endl;
+				return 1;
+			}
 		}
-	};
-
-	struct piano : public instrument_base
-	{
-		piano()
+		else if (sArg.compare(0, 2, "--") == 0)
 		{
-			env.dAttackTime = 0.100;
-			env.dDecayTime = 0.01;
-			env.dReleaseTime = 0.01;
-			env.dSustainAmplitude = 0.8;
-			//env.dStartAmplitude = 0.200;
-
-			dVolume = 1.0;
+			wcout << "Unknown option " << sArg.c_str() << endl;
+			return 1;
 		}
-
-		FTYPE sound(const FTYPE dTime, synth::note n, bool&bNoteFinished)
+		else if (sRecordFile.empty())
+			sRecordFile = sArg;
+		else
 		{
-			FTYPE dAmplitude = synth::env(dTime, env, n.on, n.off);
-
-			if (dAmplitude <= 0.0)
-				bNoteFinished = true;
-
-			FTYPE dSound =
-				+1.0 * synth::osc(n.on - dTime, synth::scale(n.id), synth::OSC_SINE, 5.0, 0.001)
-				+ 0.5 * synth::osc(n.on - dTime, synth::scale(n.id + 12), synth::OSC_SINE);
-
-			return dAmplitude * dSound * dVolume;
+			wcout << "Only one recording file can be given, not " << sArg.c_str() << endl;
+			return 1;
 		}
-	};
-}
-
-vector<synth::note> vecNotes;
-mutex muxNotes;
-synth::bell instrBell;
-synth::harmonica instrHarm;
-synth::piano instrPiano;
-
-//synth::instrument_base *voice = nullptr;
-
-typedef bool(*lambda)(synth::note const& item);
-template<class T>
-void safe_remove(T &v, lambda f)
-{
-	auto n = v.begin();
-	while (n != v.end())
-		if (!f(*n))
-			n = v.erase(n);
-		else
-			++n;
-}
-
-FTYPE MakeNoise(FTYPE dTime)
-{
-	unique_lock<mutex> lm(muxNotes);
-	FTYPE dMixedOutput = 0.0;
-
-	for (auto &n : vecNotes)
-	{
-		bool bNoteFinished = false;
-		FTYPE dSound = 0;
-
-		if (n.channel == 2)
-			dSound = instrBell.sound(dTime, n, bNoteFinished);
-		if (n.channel == 1)
-			dSound = instrHarm.sound(dTime, n, bNoteFinished);
-		if (n.channel == 0)
-			dSound = instrPiano.sound(dTime, n, bNoteFinished);
-
-		dMixedOutput += dSound;
-
-		if (bNoteFinished && n.off > n.on)
-			n.active = false;
 	}
 
-	safe_remove<vector<synth::note>>(vecNotes, [](synth::note const& item) { return item.active; });
-
-	return dMixedOutput * 0.05;		//Master volume
-}
-
-int main()
-{
-	wcout << "Synthesizer" << endl;
-
 	vector<wstring> devices = olcNoiseMaker<short>::Enumerate();
 
 	wcout << endl <<
@@ -318,11 +256,61 @@ int main()
 		//"\nPress '1' for harmonica(default),'2' for Bell and '3' for Piano" << endl << endl;
 
 
-	olcNoiseMaker<short> sound(devices[0], 44100, 1, 8, 512);
+	//Sized before the audio thread starts, so it never grows a buffer below this many voices
+	const int nMaxVoices = 64;
+	synthEngine.reserve(nMaxVoices, 512);
+
+	olcNoiseMaker<short> sound(devices[0], nSampleRate, 1, 8, 512, rtConfig);
 
 	//voice = new synth::harmonica();
 
-	sound.SetUserFunction(MakeNoise);
+	//Piano and bell notes are replayed from pre-rendered buffers where possible
+	synthEngine.set_cache_budget(32 * 1024 * 1024);
+
+	sound.SetUserBlockFunction(MakeNoise);
+
+	Recorder<short> recorder;
+	if (!sRecordFile.empty())
+	{
+		if (recorder.Open(sRecordFile, nSampleRate, 1, 512))
+		{
+			sound.SetRecorder(&recorder);
+			wcout << "Recording to " << sRecordFile.c_str() << endl;
+		}
+		else
+			wcout << "Could not open " << sRecordFile.c_str() << " for recording" << endl;
+	}
+
+	SharedRingWriter<short> sharedRing;
+	if (!sSharedRing.empty())
+	{
+		if (sharedRing.Create(wstring(sSharedRing.begin(), sSharedRing.end()), nSampleRate, 1))
+		{
+			sound.SetSharedRing(&sharedRing);
+			wcout << "Publishing output to " << sSharedRing.c_str() << endl;
+		}
+		else
+			wcout << "Could not create shared ring " << sSharedRing.c_str() << endl;
+	}
+
+	//The engine's buffers are locked here, the device's by olcNoiseMaker, and the
+	//report printed once the recorder and shared ring have been locked too
+	RealTimeReport rtReport = sound.GetRealTimeReport();
+	if (rtConfig.bLockMemory)
+	{
+		synth::memory_lock pfnLock = [](void *pAddress, size_t nBytes) { return LockMemory(pAddress, (SIZE_T)nBytes); };
+		synth::memory_lock pfnUnlock = [](void *pAddress, size_t nBytes) { return UnlockMemory(pAddress, (SIZE_T)nBytes); };
+
+		size_t nEngineBytes = 0;
+		rtReport.bEngineLocked = synthEngine.lock_buffers(pfnLock, nEngineBytes);
+		rtReport.nEngineBytes = nEngineBytes;
+		rtReport.nEngineVoices = nMaxVoices;
+
+		synthEngine.set_memory_lock(pfnLock, pfnUnlock);
+		rtReport.bCacheLocking = true;
+	}
+	PrintRealTimeReport(rtConfig, rtReport);
+	wcout << endl;
 
 	char keyboard[129];
 	memset(keyboard, ' ', 127);
@@ -332,62 +320,74 @@ int main()
 	auto clock_real_time = chrono::high_resolution_clock::now();
 	FTYPE dElapsedTime = 0.0;
 
-	while (1)
+	unique_ptr<KeySource> keys;
+	if (!sReplay.empty())
 	{
-		for (int k = 0; k < 16; k++)
+		vector<synth::note_script> vecJobs;
+		string sError;
+		if (!synth::read_manifest(sReplay, vecJobs, sError) || vecJobs.empty())
 		{
-			short nKeyState = GetAsyncKeyState((unsigned char)("ZSXCFVGBNJMK\xbcL\xbe\xbf"[k]));
+			wcout << (sError.empty() ? "No jobs in " + sReplay : sError).c_str() << endl;
+			sound.Stop();
+			return 1;
+		}
 
-			FTYPE dTimeNow = sound.GetTime();
+		vector<KeyEvent> vecEvents;
+		for (auto &ev : vecJobs[0].vecEvents)
+			vecEvents.push_back(KeyEvent(ev.dTime, ev.nNoteID, ev.nChannel, ev.bPressed));
+
+		//The script plays from a sample of the engine clock a little ahead of now, far
+		//enough that every event reaches the engine before its sample is rendered
+		const double dReplayLead = 0.1;
+		LARGE_INTEGER nNow;
+		QueryPerformanceCounter(&nNow);
+		long long nReplayStart = (long long)sound.GetClock().SampleAt(nNow.QuadPart) + (long long)(dReplayLead * nSampleRate);
+		keys.reset(new ScriptedKeySource(vecEvents, vecJobs[0].dDuration + dReplayLead, nReplayStart, nSampleRate));
+		wcout << "Replaying " << vecJobs[0].sName.c_str() << " from " << sReplay.c_str() << endl;
+	}
+	else
+	{
+		ConsoleKeySource *pConsoleKeys = new ConsoleKeySource();
+		keys.reset(pConsoleKeys);
+		if (!pConsoleKeys->IsConsole())
+		{
+			wcout << "Standard input is not a console, use --replay to play from a file" << endl;
+			sound.Stop();
+			return 1;
+		}
+		wcout << "Esc to quit" << endl;
+	}
 
-			//Check if note already exists in currently playing notes
-			muxNotes.lock();
-			auto noteFound = find_if(vecNotes.begin(), vecNotes.end(), [&k](synth::note const& item) { return item.id == k; });
-			if (noteFound == vecNotes.end())
-			{
-				if (nKeyState & 0x8000)
-				{
-					synth::note n;
-					n.id = k;
-					n.on = dTimeNow;
-					n.channel = 0;
-					n.active = true;
-
-					vecNotes.emplace_back(n);		//Adding note to vector
-				}
-				else
-				{
-					//do nothing
-				}
-			}
+	//Sleeps until a key changes state, waking at most 10 times a second to redraw the status
+	const auto tStatusPeriod = chrono::milliseconds(100);
+	auto tNextStatus = chrono::steady_clock::now();
+	while (!keys->Finished())
+	{
+		long long nWait = chrono::duration_cast<chrono::milliseconds>(tNextStatus - chrono::steady_clock::now()).count();
 
-			else
-			{
-				if (nKeyState & 0x8000)
-				{
-					if (noteFound->off > noteFound->on)
-					{
-						//Key has been pressed again during the release state
-						noteFound->on = dTimeNow;
-						noteFound->active = true;
-					}
-				}
-
-				else
-				{
-					if (noteFound->off < noteFound->on)
-					{
-						//Key has been released so switch off
-						noteFound->off = dTimeNow;
-					}
-				}
-			}
+		//Scripted events land on their own sample, keys from the console on the current one
+		KeyEvent ev;
+		if (keys->Wait(ev, (unsigned int)(std::max)(nWait, 0LL)))
+			synthEngine.key(ev.nKey, ev.nChannel, ev.bPressed, ev.nSample >= 0 ? (FTYPE)((double)ev.nSample / nSampleRate) : sound.GetTime());
 
-			muxNotes.unlock();
-		}
+		if (chrono::steady_clock::now() >= tNextStatus)
+		{
+			wcout << "\rNotes:" << synthEngine.voices() << "			";
+
+			if (recorder.IsRecording())
+				wcout << "Dropped:" << recorder.GetDroppedBlocks() << "	";
 
-		wcout << "\rNotes:" << vecNotes.size() << "			";
+			tNextStatus += tStatusPeriod;
+			if (tNextStatus < chrono::steady_clock::now())
+				tNextStatus = chrono::steady_clock::now() + tStatusPeriod;
+		}
 	}
 
+	//The audio thread uses the recorder and ring, stop it before they go
+	sound.SetRecorder(nullptr);
+	sound.SetSharedRing(nullptr);
+	sound.Stop();
+	wcout << endl;
+
 	return 0;
 }
\ No newline at end of file
@@ -63,19 +63,50 @@
 #include <thread>
 #include <atomic>
 #include <condition_variable>
+#include <mutex>
+#include <future>
 using namespace std;
 
+#include "Recorder.h"
+#include "SharedRing.h"
+#include "RealTime.h"
+
 #include <Windows.h>
 
 const double PI = 2.0 * acos(0.0);
 
+// Engine position as published by the audio thread once per block
+struct EngineClock
+{
+	unsigned long long nSample;		// First sample of the block being rendered
+	long long nHostTicks;			// QueryPerformanceCounter() when that block started
+	long long nHostFrequency;
+	unsigned int nSampleRate;
+
+	double Seconds() const
+	{
+		return (double)nSample / (double)nSampleRate;
+	}
+
+	// Maps a host timestamp (e.g. when a key event arrived) to a sample position
+	// on the engine timeline, extrapolated from the last published block
+	unsigned long long SampleAt(long long nTicks) const
+	{
+		long long nElapsed = nTicks - nHostTicks;
+		if (nElapsed <= 0 || nHostFrequency == 0)
+			return nSample;
+
+		return nSample + (unsigned long long)((double)nElapsed * nSampleRate / (double)nHostFrequency);
+	}
+};
+
 template<class T>
 class olcNoiseMaker
 {
 public:
-	olcNoiseMaker(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	olcNoiseMaker(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512, const RealTimeConfig &rtConfig = RealTimeConfig())
 	{
-		Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples);
+		Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples, rtConfig);
 	}
 
 	~olcNoiseMaker()
@@ -83,7 +114,7 @@ public:
 		Destroy();
 	}
 
-	bool Create(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	bool Create(wstring sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512, const RealTimeConfig &rtConfig = RealTimeConfig())
 	{
 		m_bReady = false;
 		m_nSampleRate = nSampleRate;
@@ -96,6 +127,19 @@ public:
 		m_pWaveHeaders = nullptr;
 
 		m_userFunction = nullptr;
+		m_userBlockFunction = nullptr;
+		m_pRecorder = nullptr;
+		m_pSharedRing = nullptr;
+		m_rtConfig = rtConfig;
+		m_rtReport = RealTimeReport();
+
+		LARGE_INTEGER nFrequency;
+		QueryPerformanceFrequency(&nFrequency);
+		m_nHostFrequency = nFrequency.QuadPart;
+		m_nSampleClock = 0;
+		m_nClockSequence = 0;
+		m_nClockSample = 0;
+		m_nClockTicks = 0;
 
 		// Validate device
 		vector<wstring> devices = Enumerate();
@@ -129,6 +173,9 @@ public:
 			return Destroy();
 		ZeroMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
 
+		// Block functions render here before conversion to T
+		m_vecMix.assign(m_nBlockSamples, 0.0);
+
 		// Link headers to block memory
 		for (unsigned int n = 0; n < m_nBlockCount; n++)
 		{
@@ -136,9 +183,23 @@ public:
 			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
 		}
 
+		// Keep everything the audio thread touches resident
+		bool bMemoryLocked = false;
+		if (m_rtConfig.bLockMemory)
+			bMemoryLocked =
+				LockMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples) &&
+				LockMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount) &&
+				LockMemory(&m_vecMix[0], sizeof(double) * m_nBlockSamples);
+
 		m_bReady = true;
 
+		// Priority, affinity and FP mode can only be set from the thread itself,
+		// so wait for it to report back what it was granted
+		m_rtPromise = promise<RealTimeReport>();
+		future<RealTimeReport> rtReport = m_rtPromise.get_future();
 		m_thread = thread(&olcNoiseMaker::MainThread, this);
+		m_rtReport = rtReport.get();
+		m_rtReport.bMemoryLocked = bMemoryLocked;
 
 		// Start the ball rolling
 		unique_lock<mutex> lm(m_muxBlockNotZero);
@@ -164,9 +225,53 @@ public:
 		return 0.0;
 	}
 
+	// Lock-free snapshot of the engine clock, safe to call from any thread
+	EngineClock GetClock()
+	{
+		EngineClock clock;
+		clock.nHostFrequency = m_nHostFrequency;
+		clock.nSampleRate = m_nSampleRate;
+
+		// Seqlock read: retry if the audio thread published while we were reading
+		unsigned int nSequence;
+		do
+		{
+			nSequence = m_nClockSequence.load(memory_order_acquire);
+			clock.nSample = m_nClockSample.load(memory_order_relaxed);
+			clock.nHostTicks = m_nClockTicks.load(memory_order_relaxed);
+			atomic_thread_fence(memory_order_acquire);
+		} while ((nSequence & 1) || nSequence != m_nClockSequence.load(memory_order_relaxed));
+
+		return clock;
+	}
+
+	// Sample position corresponding to "now", never further ahead than the
+	// block the audio thread is working on
+	unsigned long long GetSample()
+	{
+		EngineClock clock = GetClock();
+		LARGE_INTEGER nNow;
+		QueryPerformanceCounter(&nNow);
+
+		unsigned long long nSample = clock.SampleAt(nNow.QuadPart);
+		unsigned long long nLimit = clock.nSample + m_nBlockSamples;
+		return nSample < nLimit ? nSample : nLimit;
+	}
+
 	double GetTime()
 	{
-		return m_dGlobalTime;
+		return (double)GetSample() / (double)m_nSampleRate;
+	}
+
+	// What the audio thread was actually granted of the requested RealTimeConfig
+	const RealTimeReport &GetRealTimeReport()
+	{
+		return m_rtReport;
+	}
+
+	const RealTimeConfig &GetRealTimeConfig()
+	{
+		return m_rtConfig;
 	}
 
 	
@@ -188,6 +293,32 @@ public:
 		m_userFunction = func;
 	}
 
+	// Renders a whole block at once, nStartSample is the engine clock position of
+	// pOutput[0]. When set it is used instead of the per sample function.
+	void SetUserBlockFunction(void(*func)(unsigned long long nStartSample, double *pOutput, unsigned int nSamples))
+	{
+		m_userBlockFunction = func;
+	}
+
+	// Every finished block is also copied to the recorder. Pass nullptr to detach
+	// before the recorder is closed or destroyed. The recorder must be open, its
+	// ring is locked like the rest of the audio thread's buffers.
+	void SetRecorder(Recorder<T> *pRecorder)
+	{
+		if (pRecorder != nullptr && m_rtConfig.bLockMemory)
+			m_rtReport.bRecorderLocked = pRecorder->LockRing();
+		m_pRecorder = pRecorder;
+	}
+
+	// Every finished block is also published to other processes through the
+	// shared ring. Pass nullptr to detach before the ring is closed or destroyed.
+	void SetSharedRing(SharedRingWriter<T> *pSharedRing)
+	{
+		if (pSharedRing != nullptr)
+			m_rtReport.bSharedRingLocked = pSharedRing->IsLocked();
+		m_pSharedRing = pSharedRing;
+	}
+
 	double clip(double dSample, double dMax)
 	{
 		if (dSample >= 0.0)
@@ -199,6 +330,8 @@ public:
 
 private:
 	double(*m_userFunction)(double);
+	void(*m_userBlockFunction)(unsigned long long, double*, unsigned int);
+	vector<double> m_vecMix;
 
 	unsigned int m_nSampleRate;
 	unsigned int m_nChannels;
@@ -216,7 +349,33 @@ private:
 	condition_variable m_cvBlockNotZero;
 	mutex m_muxBlockNotZero;
 
-	atomic<double> m_dGlobalTime;
+	// Engine clock, an integer sample count owned by the audio thread and
+	// published once per block so readers never see a torn value
+	unsigned long long m_nSampleClock;
+	long long m_nHostFrequency;
+	atomic<unsigned int> m_nClockSequence;
+	atomic<unsigned long long> m_nClockSample;
+	atomic<long long> m_nClockTicks;
+
+	void PublishClock(unsigned long long nSample)
+	{
+		LARGE_INTEGER nNow;
+		QueryPerformanceCounter(&nNow);
+
+		unsigned int nSequence = m_nClockSequence.load(memory_order_relaxed);
+		m_nClockSequence.store(nSequence + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		m_nClockSample.store(nSample, memory_order_relaxed);
+		m_nClockTicks.store(nNow.QuadPart, memory_order_relaxed);
+		m_nClockSequence.store(nSequence + 2, memory_order_release);
+	}
+
+	atomic<Recorder<T>*> m_pRecorder;
+	atomic<SharedRingWriter<T>*> m_pSharedRing;
+
+	RealTimeConfig m_rtConfig;
+	RealTimeReport m_rtReport;
+	promise<RealTimeReport> m_rtPromise;
 
 	// Handler for soundcard request for more data
 	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
@@ -240,7 +399,11 @@ private:
 	// and then issued to the soundcard.
 	void MainThread()
 	{
-		m_dGlobalTime = 0.0;
+		RealTimeReport rtReport = ApplyRealTime(m_rtConfig);
+		m_rtPromise.set_value(rtReport);
+
+		m_nSampleClock = 0;
+		PublishClock(m_nSampleClock);
 		double dTimeStep = 1.0 / (double)m_nSampleRate;
 
 		// Goofy hack to get maximum integer for a type at run-time
@@ -266,19 +429,50 @@ private:
 
 			T nNewSample = 0;
 			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
-			
-			for (unsigned int n = 0; n < m_nBlockSamples; n++)
+			unsigned long long nBlockStart = m_nSampleClock;
+			PublishClock(nBlockStart);
+
+			if (m_userBlockFunction != nullptr)
 			{
-				// User Process
-				if (m_userFunction == nullptr)
-					nNewSample = (T)(clip(UserProcess(m_dGlobalTime), 1.0) * dMaxSample);
-				else
-					nNewSample = (T)(clip(m_userFunction(m_dGlobalTime), 1.0) * dMaxSample);
-
-				m_pBlockMemory[nCurrentBlock + n] = nNewSample;
-				nPreviousSample = nNewSample;
-				m_dGlobalTime = m_dGlobalTime + dTimeStep;
+				// User Block Process
+				m_userBlockFunction(nBlockStart, &m_vecMix[0], m_nBlockSamples);
+
+				for (unsigned int n = 0; n < m_nBlockSamples; n++)
+				{
+					nNewSample = (T)(clip(m_vecMix[n], 1.0) * dMaxSample);
+					m_pBlockMemory[nCurrentBlock + n] = nNewSample;
+					nPreviousSample = nNewSample;
+				}
 			}
+			else
+			{
+				for (unsigned int n = 0; n < m_nBlockSamples; n++)
+				{
+					// Derived from the integer clock each sample, so no error accumulates
+					double dTime = (double)(nBlockStart + n) * dTimeStep;
+
+					// User Process
+					if (m_userFunction == nullptr)
+						nNewSample = (T)(clip(UserProcess(dTime), 1.0) * dMaxSample);
+					else
+						nNewSample = (T)(clip(m_userFunction(dTime), 1.0) * dMaxSample);
+
+					m_pBlockMemory[nCurrentBlock + n] = nNewSample;
+					nPreviousSample = nNewSample;
+				}
+			}
+
+			m_nSampleClock = nBlockStart + m_nBlockSamples;
+
+			// Tap the block for recording, this never waits on the disk
+			Recorder<T> *pRecorder = m_pRecorder;
+			if (pRecorder != nullptr)
+				pRecorder->PushBlock(&m_pBlockMemory[nCurrentBlock], m_nBlockSamples);
+
+			// Same for local reader processes, slow readers fall behind on their own
+			SharedRingWriter<T> *pSharedRing = m_pSharedRing;
+			if (pSharedRing != nullptr)
+				pSharedRing->PushBlock(&m_pBlockMemory[nCurrentBlock], m_nBlockSamples);
 
 			// Send block to sound device
 			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
@@ -286,5 +480,7 @@ private:
 			m_nBlockCurrent++;
 			m_nBlockCurrent %= m_nBlockCount;
 		}
+
+		RevertRealTime(rtReport);
 	}
 };